@@ -83,17 +83,6 @@ zf_input_state zf_host_sys(zf_ctx *ctx, zf_syscall_id id, const char *input)
 }
 
 
-zf_cell zf_host_parse_num(zf_ctx *ctx, const char *buf)
-{
-	char *end;
-        zf_cell v = strtol(buf, &end, 0);
-	if(*end != '\0') {
-                zf_abort(ctx, ZF_ABORT_NOT_A_WORD);
-        }
-        return v;
-}
-
-
 void uart_init(uint16_t baudrate)
 {
 	UBRRH = (baudrate >> 8);			/* Set the baudrate [p.132] */
@@ -0,0 +1,143 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "cache.h"
+
+
+#define CACHE_MAGIC 0x3143465a /* "ZFC1" */
+
+
+/*
+ * 64 bit FNV-1a hash, chained through 'h'
+ */
+
+uint64_t cache_hash(uint64_t h, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	while(len--) {
+		h ^= *p++;
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+
+static void cache_path(const char *dir, uint64_t key, char *path, size_t len)
+{
+	snprintf(path, len, "%s/%016llx", dir, (unsigned long long)key);
+}
+
+
+/*
+ * Apply the cached dictionary changes for 'key'. Returns 1 on a hit; a
+ * missing or damaged entry leaves the dictionary untouched.
+ */
+
+int cache_load(const char *dir, uint64_t key, uint8_t *dict, size_t size)
+{
+	char path[256];
+	uint32_t hdr[2], run[2];
+	uint8_t *tmp;
+	FILE *f;
+	int ok = 0;
+
+	cache_path(dir, key, path, sizeof(path));
+	f = fopen(path, "rb");
+	if(f == NULL) {
+		return 0;
+	}
+
+	/* Apply to a copy first, so a truncated file does no harm */
+
+	tmp = malloc(size);
+	if(tmp && fread(hdr, sizeof(hdr), 1, f) == 1 && hdr[0] == CACHE_MAGIC && hdr[1] == size) {
+		memcpy(tmp, dict, size);
+		while(fread(run, sizeof(run), 1, f) == 1) {
+			if(run[1] == 0) {
+				ok = 1;
+				break;
+			}
+			if(run[0] > size || run[1] > size - run[0]) break;
+			if(fread(tmp + run[0], 1, run[1], f) != run[1]) break;
+		}
+		if(ok) {
+			memcpy(dict, tmp, size);
+		}
+	}
+
+	free(tmp);
+	fclose(f);
+	return ok;
+}
+
+
+/*
+ * Store the runs of bytes that differ between 'old' and 'dict', and all bytes
+ * in the spans, which may be equal to what happened to be there before
+ */
+
+static int changed(const uint8_t *old, const uint8_t *dict, size_t i,
+		const struct cache_span *spans, int count)
+{
+	int k;
+
+	if(old[i] != dict[i]) {
+		return 1;
+	}
+	for(k=0; k<count; k++) {
+		if(i >= spans[k].start && i < spans[k].end) return 1;
+	}
+	return 0;
+}
+
+int cache_store(const char *dir, uint64_t key, const uint8_t *old, const uint8_t *dict, size_t size,
+		const struct cache_span *spans, int count)
+{
+	char path[256], tmp[280];
+	uint32_t hdr[2] = { CACHE_MAGIC, size };
+	uint32_t run[2];
+	size_t i = 0, j;
+	FILE *f;
+
+	mkdir(dir, 0777);
+	cache_path(dir, key, path, sizeof(path));
+	snprintf(tmp, sizeof(tmp), "%s/%016llx.%d", dir, (unsigned long long)key, (int)getpid());
+
+	f = fopen(tmp, "wb");
+	if(f == NULL) {
+		return 0;
+	}
+
+	fwrite(hdr, sizeof(hdr), 1, f);
+
+	while(i < size) {
+		if(!changed(old, dict, i, spans, count)) {
+			i ++;
+			continue;
+		}
+		for(j=i; j<size && changed(old, dict, j, spans, count); j++);
+		run[0] = i;
+		run[1] = j - i;
+		fwrite(run, sizeof(run), 1, f);
+		fwrite(dict + i, 1, j - i, f);
+		i = j;
+	}
+
+	run[0] = run[1] = 0;
+	fwrite(run, sizeof(run), 1, f);
+
+	if(fclose(f) != 0 || rename(tmp, path) != 0) {
+		unlink(tmp);
+		return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * End
+ */
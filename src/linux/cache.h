@@ -0,0 +1,26 @@
+#ifndef cache_h
+#define cache_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* On-disk cache of dictionary changes made by including a file. The key
+ * covers everything the result depends on: the source, the used part of the
+ * dictionary and the stack before the include and the build. A cached entry
+ * holds the byte runs that changed, which are copied back in place. The
+ * unused part of the dictionary is not in the key, so what the include
+ * added there is kept whole, given as spans */
+
+#define CACHE_HASH_INIT 0xcbf29ce484222325ULL
+
+struct cache_span {
+	size_t start;
+	size_t end;
+};
+
+uint64_t cache_hash(uint64_t h, const void *buf, size_t len);
+int cache_load(const char *dir, uint64_t key, uint8_t *dict, size_t size);
+int cache_store(const char *dir, uint64_t key, const uint8_t *old, const uint8_t *dict, size_t size,
+		const struct cache_span *spans, int count);
+
+#endif
@@ -1,4 +1,6 @@
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdarg.h>
 #include <errno.h>
@@ -6,6 +8,19 @@
 #include <stdlib.h>
 #include <getopt.h>
 #include <math.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <inttypes.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <netinet/in.h>
 
 #ifdef USE_READLINE
 #include <readline/readline.h>
@@ -13,22 +28,121 @@
 #endif
 
 #include "zforth.h"
+#include "output.h"
+#include "cache.h"
+#include "queue.h"
+#include "replay.h"
+
+
+/*
+ * A session is a context with its own input and output. The context is the
+ * first member, so the ctx passed to zf_host_sys() also points to the session.
+ * Async sessions are driven by the event loop: system calls waiting for I/O
+ * park the session and return ZF_INPUT_PENDING instead of blocking.
+ */
+
+struct session {
+	zf_ctx ctx;
+	int fd_in;              /* input lines for the interpreter */
+	int fd_out;             /* destination of the output buffer */
+	int async;              /* park on I/O instead of blocking */
+	int depth;              /* include nesting, evaluates synchronously */
+	int busy;               /* evaluating a line, possibly suspended */
+	int parked;             /* waiting for an fd in the event loop */
+	int quit;               /* close when the current line is done */
+	int dead;               /* peer hung up, close instead of running */
+	int impure;             /* host side effects during the current include */
+	int log;                /* record or replay host functions */
+	struct profile *prof;   /* counters of 'profile', or NULL */
+	struct output out;      /* output of emit, tell and . */
+	size_t in_len;
+	char in[1024];          /* received input */
+	char cmd[1024];         /* line being evaluated */
+	struct session *next;   /* ready list */
+};
+
+#define SESSION(ctx) ((struct session *)(ctx))
+
+#define SESSION_SLICE 10000
+
+
+static int check = 0;
+static int trace = 0;
+static const char *fname_load = NULL;
+static const char *cache_dir = NULL;
+#if ZF_ENABLE_IMAGE_TOOLS
+static const char *fname_compact = NULL;
+static char *roots = NULL;
+#endif
+static const char *fname_snapshot = NULL;
+static char **srcs = NULL;
+static int nsrcs = 0;
+
+static int epfd = -1;
+static FILE *rec_file = NULL;
+static FILE *play_file = NULL;
+static struct session *ready_head = NULL;
+static struct session *ready_tail = NULL;
+#if ZF_ENABLE_PRIM_STATS
+static const char *fname_stats = NULL;
+static zf_ctx *stats_ctx = NULL;
+static uint64_t *stats = NULL;
+#endif
 
+void include(zf_ctx *ctx, const char *fname);
 
 
 /*
- * Evaluate buffer with code, check return value and report errors
+ * Buffered session output. When the buffer can not be flushed because the fd
+ * is not writable, async sessions park and the calling syscall returns
+ * pending; the output buffer keeps track of its progress, so the retried call
+ * continues where it left off. Both return nonzero when pending.
  */
 
-zf_result do_eval(zf_ctx *ctx, const char *src, int line, const char *buf)
+static int wait_fd(struct session *s, int fd, short events);
+
+static int output(struct session *s, const char *buf, size_t len)
 {
-	const char *msg = NULL;
+	s->impure = 1;
+	while(output_write(&s->out, buf, len) == -1) {
+		if(wait_fd(s, s->fd_out, POLLOUT)) return 1;
+	}
+	return 0;
+}
+
+static int flush(struct session *s)
+{
+	while(output_flush(&s->out) == -1) {
+		if(wait_fd(s, s->fd_out, POLLOUT)) return 1;
+	}
+	return 0;
+}
+
+
+/*
+ * Output of the main session goes through stdio, so it stays in order with
+ * the other messages of the interpreter
+ */
 
-	zf_result rv = zf_eval(ctx, buf);
+static void stdio_write(void *arg, const char *buf, size_t len)
+{
+	(void)fwrite(buf, 1, len, (FILE *)arg);
+	fflush((FILE *)arg);
+}
+
+
+/*
+ * Report evaluation errors on stderr, or to the peer of a network session
+ */
+
+static void report(struct session *s, const char *src, int line, zf_result rv)
+{
+	const char *msg = NULL;
 
 	switch(rv)
 	{
 		case ZF_OK: break;
+		case ZF_YIELD: break;
 		case ZF_ABORT_INTERNAL_ERROR: msg = "internal error"; break;
 		case ZF_ABORT_OUTSIDE_MEM: msg = "outside memory"; break;
 		case ZF_ABORT_DSTACK_OVERRUN: msg = "dstack overrun"; break;
@@ -39,34 +153,334 @@ zf_result do_eval(zf_ctx *ctx, const char *src, int line, const char *buf)
 		case ZF_ABORT_COMPILE_ONLY_WORD: msg = "compile-only word"; break;
 		case ZF_ABORT_INVALID_SIZE: msg = "invalid size"; break;
 		case ZF_ABORT_DIVISION_BY_ZERO: msg = "division by zero"; break;
+		case ZF_ABORT_NO_FREE_TASK: msg = "no free task"; break;
+		case ZF_ABORT_THROW: msg = "uncaught throw"; break;
 		default: msg = "unknown error";
 	}
 
-	if(msg) {
+	if(msg == NULL) {
+		return;
+	}
+
+	if(s->fd_out == STDOUT_FILENO) {
+		flush(s);
 		fprintf(stderr, "\033[31m");
 		if(src) fprintf(stderr, "%s:%d: ", src, line);
 		fprintf(stderr, "%s\033[0m\n", msg);
+	} else {
+		char buf[256];
+		int len = src ? snprintf(buf, sizeof(buf), "%s:%d: %s\n", src, line, msg) :
+		                snprintf(buf, sizeof(buf), "%s\n", msg);
+		s->depth ++;
+		output(s, buf, len < (int)sizeof(buf) ? len : (int)sizeof(buf) - 1);
+		s->depth --;
+	}
+}
+
+
+/*
+ * Run time of the lines evaluated at the top level of a logged session. When
+ * recording, the line and its run time are logged; when replaying, the run
+ * time is compared with the recorded one.
+ */
+
+struct log_time {
+	uint64_t ns;
+	int64_t result;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void log_diverged(const char *what)
+{
+	fflush(stdout);
+	fprintf(stderr, "replay diverged at %s\n", what);
+	exit(1);
+}
+
+static void log_line(int line, uint64_t ns, zf_result rv)
+{
+	struct log_time t, *rt;
+	replay_type type;
+	size_t len;
+
+	t.ns = ns;
+	t.result = rv;
+
+	if(rec_file) {
+		replay_put(rec_file, REPLAY_TIME, &t, sizeof(t));
+		return;
+	}
+
+	rt = replay_get(play_file, &type, &len);
+	if(rt == NULL || type != REPLAY_TIME || len != sizeof(*rt)) {
+		log_diverged("end of line");
 	}
+	fflush(stdout);
+	fprintf(stderr, "replay:%d: %.3f ms, recorded %.3f ms%s\n", line,
+			ns / 1e6, rt->ns / 1e6, rt->result == rv ? "" : ", other result");
+	free(rt);
+}
+
+
+/*
+ * Evaluate buffer with code, check return value and report errors
+ */
 
+zf_result do_eval(zf_ctx *ctx, const char *src, int line, const char *buf)
+{
+	struct session *s = SESSION(ctx);
+	int top = s->log && s->depth == 0;
+	uint64_t t = 0;
+	zf_result rv;
+
+	if(top) {
+		if(rec_file) replay_put(rec_file, REPLAY_EVAL, buf, strlen(buf));
+		t = now_ns();
+	}
+	rv = zf_eval(ctx, buf);
+	if(top) {
+		t = now_ns() - t;
+	}
+	report(s, src, line, rv);
+	flush(s);
+	if(top) {
+		log_line(line, t, rv);
+	}
 	return rv;
 }
 
 
+#if ZF_ENABLE_ANALYZE
+
+/*
+ * Format the inferred stack effect of a word
+ */
+
+static int format_effect(zf_ctx *ctx, zf_addr xt, char *buf, size_t len)
+{
+	zf_effect e;
+
+	switch(zf_analyze(ctx, xt, &e)) {
+		case ZF_EFFECT_OK:
+			return snprintf(buf, len, "( %d -- %d ) dstack %d rstack %d ",
+					e.din, e.dout, e.dmax, e.rmax);
+		case ZF_EFFECT_UNBALANCED: return snprintf(buf, len, "unbalanced ");
+		case ZF_EFFECT_DYNAMIC: return snprintf(buf, len, "dynamic ");
+		case ZF_EFFECT_INVALID: return snprintf(buf, len, "invalid ");
+	}
+	return 0;
+}
+
+
+/*
+ * Stack effect checking: a definition starting with ': name ( a b -- c )'
+ * declares its effect in the comment, which is compared with the effect
+ * inferred by zf_analyze() once the definition is complete. Immediate words
+ * are skipped since their comments describe the compiled code.
+ */
+
+struct decl {
+	char name[32];
+	int din, dout;
+	int line;
+};
+
+static int parse_decl(const char *buf, struct decl *decl)
+{
+	char tok[4][32];
+	int n = 0, side = 0, found = 0, len;
+
+	decl->din = decl->dout = 0;
+
+	while(sscanf(buf, "%31s%n", tok[n < 3 ? n : 3], &len) == 1) {
+		buf += len;
+		if(n < 3) {
+			n ++;
+			if(n == 3) {
+				if(strcmp(tok[0], ":") != 0 || strcmp(tok[2], "(") != 0) return 0;
+				strcpy(decl->name, tok[1]);
+			}
+		} else if(strcmp(tok[3], "immediate") == 0) {
+			return 0;
+		} else if(found) {
+			continue;
+		} else if(strcmp(tok[3], "--") == 0) {
+			side = 1;
+		} else if(strcmp(tok[3], ")") == 0) {
+			found = side;
+			if(!found) return 0;
+		} else {
+			if(side) decl->dout ++; else decl->din ++;
+		}
+	}
+
+	return found;
+}
+
+static void check_decl(zf_ctx *ctx, const char *fname, struct decl *decl)
+{
+	zf_addr xt;
+	zf_effect e;
+	zf_effect_status status;
+
+	if(!zf_find(ctx, decl->name, &xt)) return;
+
+	status = zf_analyze(ctx, xt, &e);
+
+	if(status == ZF_EFFECT_UNBALANCED) {
+		fprintf(stderr, "%s:%d: '%s' has an unbalanced stack effect\n",
+				fname, decl->line, decl->name);
+	}
+
+	if(status == ZF_EFFECT_OK) {
+		if(e.din > decl->din) {
+			fprintf(stderr, "%s:%d: '%s' underruns the data stack: declared ( %d -- %d ), inferred ( %d -- %d )\n",
+					fname, decl->line, decl->name, decl->din, decl->dout, e.din, e.dout);
+		} else if(e.dout - e.din != decl->dout - decl->din) {
+			fprintf(stderr, "%s:%d: '%s' does not match its declaration: declared ( %d -- %d ), inferred ( %d -- %d )\n",
+					fname, decl->line, decl->name, decl->din, decl->dout, e.din, e.dout);
+		}
+	}
+}
+
+#endif
+
+
+/*
+ * Include cache, see cache.c. The key covers the interpreter binary, the
+ * used part of the dictionary, the data stack and the source file.
+ */
+
+static uint64_t include_key(zf_ctx *ctx, FILE *f)
+{
+	static uint64_t exe_hash = 0;
+	uint8_t *dict = zf_dump(ctx, NULL);
+	uint8_t buf[4096];
+	zf_cell here, hp, dsp;
+	uint64_t h;
+	size_t n;
+
+	if(exe_hash == 0) {
+		FILE *exe = fopen("/proc/self/exe", "rb");
+		exe_hash = CACHE_HASH_INIT;
+		if(exe) {
+			while((n = fread(buf, 1, sizeof(buf), exe)) > 0) {
+				exe_hash = cache_hash(exe_hash, buf, n);
+			}
+			fclose(exe);
+		}
+	}
+
+	zf_uservar_get(ctx, ZF_USERVAR_HERE, &here);
+	zf_uservar_get(ctx, ZF_USERVAR_HP, &hp);
+	zf_uservar_get(ctx, ZF_USERVAR_DSP, &dsp);
+
+	h = cache_hash(exe_hash, dict, here);
+	if(hp) h = cache_hash(h, dict + (size_t)hp, ZF_DICT_SIZE - (size_t)hp);
+	h = cache_hash(h, ctx->dstack, (size_t)dsp * sizeof(zf_cell));
+	while((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+		h = cache_hash(h, buf, n);
+	}
+	rewind(f);
+
+	return h;
+}
+
+
 /*
- * Load given forth file
+ * Load given forth file. With a cache directory, the dictionary changes of an
+ * include are stored if it only changed the dictionary: it did not fail, left
+ * the stack as it was, and called no host functions with side effects, which
+ * mark the session impure. The next time the changes are copied back instead
+ * of evaluating the file.
  */
 
 void include(zf_ctx *ctx, const char *fname)
 {
+	struct session *s = SESSION(ctx);
 	char buf[256];
+#if ZF_ENABLE_ANALYZE
+	struct decl decl;
+	int pending = 0;
+#endif
+	uint8_t *old = NULL;
+	uint64_t key = 0;
+	zf_cell stack[ZF_DSTACK_SIZE];
+	zf_cell dsp = 0, dsp_end;
+	zf_cell here = 0, hp = 0, here_end, hp_end;
+	struct cache_span spans[2];
+	int impure = s->impure, failed = 0, n = 0;
 
 	FILE *f = fopen(fname, "rb");
 	int line = 1;
 	if(f) {
+		if(cache_dir && !check) {
+			key = include_key(ctx, f);
+			if(cache_load(cache_dir, key, zf_dump(ctx, NULL), ZF_DICT_SIZE)) {
+				fclose(f);
+				return;
+			}
+			zf_uservar_get(ctx, ZF_USERVAR_DSP, &dsp);
+			zf_uservar_get(ctx, ZF_USERVAR_HERE, &here);
+			zf_uservar_get(ctx, ZF_USERVAR_HP, &hp);
+			old = dsp <= ZF_DSTACK_SIZE ? malloc(ZF_DICT_SIZE) : NULL;
+			if(old) {
+				memcpy(old, zf_dump(ctx, NULL), ZF_DICT_SIZE);
+				memcpy(stack, ctx->dstack, (size_t)dsp * sizeof(zf_cell));
+				s->impure = 0;
+			}
+		}
 		while(fgets(buf, sizeof(buf), f)) {
-			do_eval(ctx, fname, line++, buf);
+#if ZF_ENABLE_ANALYZE
+			if(check && parse_decl(buf, &decl)) {
+				decl.line = line;
+				pending = 1;
+			}
+#endif
+			if(do_eval(ctx, fname, line++, buf) != ZF_OK) {
+				failed = 1;
+			}
+#if ZF_ENABLE_ANALYZE
+			if(pending) {
+				zf_cell compiling;
+				zf_uservar_get(ctx, ZF_USERVAR_COMPILING, &compiling);
+				if(!compiling) {
+					check_decl(ctx, fname, &decl);
+					pending = 0;
+				}
+			}
+#endif
 		}
 		fclose(f);
+		if(old) {
+			zf_uservar_get(ctx, ZF_USERVAR_DSP, &dsp_end);
+			zf_uservar_get(ctx, ZF_USERVAR_HERE, &here_end);
+			zf_uservar_get(ctx, ZF_USERVAR_HP, &hp_end);
+
+			/* Code and split headers added outside the part
+			 * covered by the key */
+
+			if(here_end > here) {
+				spans[n].start = here;
+				spans[n++].end = here_end;
+			}
+			if(hp && hp_end < hp) {
+				spans[n].start = hp_end;
+				spans[n++].end = hp;
+			}
+			if(!failed && !s->impure && dsp_end == dsp &&
+			   memcmp(stack, ctx->dstack, (size_t)dsp * sizeof(zf_cell)) == 0) {
+				cache_store(cache_dir, key, old, zf_dump(ctx, NULL), ZF_DICT_SIZE, spans, n);
+			}
+			s->impure |= impure;
+			free(old);
+		}
 	} else {
 		fprintf(stderr, "error opening file '%s': %s\n", fname, strerror(errno));
 	}
@@ -74,207 +488,1960 @@ void include(zf_ctx *ctx, const char *fname)
 
 
 /*
- * Save dictionary
+ * Save the used part of the dictionary, up to HERE. Split headers are at the
+ * end, so then all of it is saved
  */
 
 static void save(zf_ctx *ctx, const char *fname)
 {
+	zf_cell here, hp;
 	size_t len;
 	void *p = zf_dump(ctx, &len);
 	FILE *f = fopen(fname, "wb");
+	zf_uservar_get(ctx, ZF_USERVAR_HERE, &here);
+	zf_uservar_get(ctx, ZF_USERVAR_HP, &hp);
 	if(f) {
-		fwrite(p, 1, len, f);
+		fwrite(p, 1, hp ? len : (size_t)here, f);
 		fclose(f);
 	}
 }
 
 
 /*
- * Load dictionary
+ * Write a snapshot of the state, with the stacks and native words
  */
 
-static void load(zf_ctx *ctx, const char *fname)
+static void snapshot(zf_ctx *ctx, const char *fname)
 {
-	size_t len;
-	void *p = zf_dump(ctx, &len);
-	FILE *f = fopen(fname, "rb");
-	if(f) {
-		fread(p, 1, len, f);
-		fclose(f);
+	size_t len = zf_snapshot(ctx, NULL, 0);
+	void *p = malloc(len);
+	FILE *f = fopen(fname, "wb");
+	if(p && f && zf_snapshot(ctx, p, len) == len) {
+		fwrite(p, 1, len, f);
 	} else {
-		perror("read");
+		perror(fname);
 	}
+	if(f) fclose(f);
+	free(p);
 }
 
 
 /*
- * Sys callback function
+ * Load dictionary, or restore a snapshot. A snapshot which does not fit
+ * the interpreter is fatal
  */
 
-zf_input_state zf_host_sys(zf_ctx *ctx, zf_syscall_id id, const char *input)
+static void load(zf_ctx *ctx, const char *fname)
 {
-	switch((int)id) {
-
+	size_t len;
+	void *p = zf_dump(ctx, &len);
+	FILE *f = fopen(fname, "rb");
+	uint8_t *buf;
+	long n;
 
-		/* The core system callbacks */
+	if(f == NULL) {
+		perror("read");
+		return;
+	}
+	fseek(f, 0, SEEK_END);
+	n = ftell(f);
+	rewind(f);
+	buf = malloc(n > 0 ? n : 1);
+	if(buf == NULL || n < 0 || fread(buf, 1, n, f) != (size_t)n) {
+		perror("read");
+		exit(1);
+	}
+	fclose(f);
 
-		case ZF_SYSCALL_EMIT:
-			putchar((char)zf_pop(ctx));
-			fflush(stdout);
-			break;
+	if(n >= (long)sizeof(uint32_t) && *(uint32_t *)buf == ZF_SNAPSHOT_MAGIC) {
+		if(zf_restore(ctx, buf, n) != ZF_OK) {
+			fprintf(stderr, "%s: invalid snapshot\n", fname);
+			exit(1);
+		}
+	} else {
+		memcpy(p, buf, (size_t)n < len ? (size_t)n : len);
+	}
+	free(buf);
+}
 
-		case ZF_SYSCALL_PRINT:
-			printf(ZF_CELL_FMT " ", zf_pop(ctx));
-			break;
 
-		case ZF_SYSCALL_TELL: {
-			zf_cell len = zf_pop(ctx);
-			zf_cell addr = zf_pop(ctx);
-			if(addr >= ZF_DICT_SIZE - len) {
-				zf_abort(ctx, ZF_ABORT_OUTSIDE_MEM);
-			}
-			void *buf = (uint8_t *)zf_dump(ctx, NULL) + (int)addr;
-			(void)fwrite(buf, 1, len, stdout);
-			fflush(stdout); }
-			break;
+/*
+ * Event loop. Sessions are either parked in epoll waiting for an fd, or on the
+ * ready list when their instruction budget was spent. Each session waits for
+ * at most one fd at a time; an fd can have only one waiting session.
+ */
 
+static void park(struct session *s, int fd, short events)
+{
+	struct epoll_event ev;
 
-		/* Application specific callbacks */
+	ev.events = EPOLLONESHOT | EPOLLRDHUP;
+	if(events & POLLIN) ev.events |= EPOLLIN;
+	if(events & POLLOUT) ev.events |= EPOLLOUT;
+	ev.data.ptr = s;
 
-		case ZF_SYSCALL_USER + 0:
-			printf("\n");
-			exit(0);
-			break;
+	if(epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev) == -1) {
+		if(errno != ENOENT || epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+			perror("epoll_ctl");
+			exit(1);
+		}
+	}
 
-		case ZF_SYSCALL_USER + 1:
-			zf_push(ctx, sin(zf_pop(ctx)));
-			break;
+	s->parked = 1;
+}
 
-		case ZF_SYSCALL_USER + 2:
-			if(input == NULL) {
-				return ZF_INPUT_PASS_WORD;
-			}
-			include(ctx, input);
-			break;
-		
-		case ZF_SYSCALL_USER + 3:
-			save(ctx, "zforth.save");
-			break;
 
-		default:
-			printf("unhandled syscall %d\n", id);
-			break;
+static void ready(struct session *s)
+{
+	s->next = NULL;
+	if(ready_tail) {
+		ready_tail->next = s;
+	} else {
+		ready_head = s;
 	}
-
-	return ZF_INPUT_INTERPRET;
+	ready_tail = s;
 }
 
 
 /*
- * Tracing output
+ * True when the peer of a network session went away
  */
 
-void zf_host_trace(zf_ctx *ctx, const char *fmt, va_list va)
+static int hung_up(int fd)
 {
-	fprintf(stderr, "\033[1;30m");
-	vfprintf(stderr, fmt, va);
-	fprintf(stderr, "\033[0m");
+	struct pollfd pfd;
+
+	pfd.fd = fd;
+	pfd.events = POLLRDHUP;
+
+	return poll(&pfd, 1, 0) == 1 && (pfd.revents & (POLLRDHUP | POLLHUP | POLLERR));
 }
 
 
 /*
- * Parse number
+ * Wait until fd is ready for the given poll events. Sync sessions block,
+ * async sessions are parked; returns nonzero when the syscall is pending.
  */
 
-zf_cell zf_host_parse_num(zf_ctx *ctx, const char *buf)
+static int wait_fd(struct session *s, int fd, short events)
 {
-	zf_cell v;
-	int n = 0;
-	int r = sscanf(buf, ZF_SCAN_FMT"%n", &v, &n);
-	if(r != 1 || buf[n] != '\0') {
-		zf_abort(ctx, ZF_ABORT_NOT_A_WORD);
+	struct pollfd pfd;
+
+	pfd.fd = fd;
+	pfd.events = events;
+
+	if(poll(&pfd, 1, 0) != 0) {
+		return 0;
 	}
-	return v;
-}
 
+	if(!s->async || s->depth > 0) {
+		(void)poll(&pfd, 1, -1);
+		return 0;
+	}
 
-void usage(void)
-{
-	fprintf(stderr, 
-		"usage: zfort [options] [src ...]\n"
-		"\n"
-		"Options:\n"
-		"   -h         show help\n"
-		"   -t         enable tracing\n"
-		"   -l FILE    load dictionary from FILE\n"
-		"   -q         quiet\n"
-	);
+	park(s, fd, events);
+	return 1;
 }
 
 
 /*
- * Main
+ * Dictionaries are mapped memory, so only the pages in use take space. The
+ * server keeps the dictionary of its template session in a memfd, which the
+ * sessions map private: they share its pages until they write to them.
+ * Without ZF_ENABLE_EXTERNAL_DICT the dictionary is part of the context, and
+ * a session copies the mapping and drops it.
  */
 
-int main(int argc, char **argv)
+static uint8_t *dict_map(int fd, int flags)
 {
-	int i;
-	int c;
-	int trace = 0;
-	int line = 0;
-	int quiet = 0;
-	const char *fname_load = NULL;
+	void *p = mmap(NULL, ZF_DICT_SIZE, PROT_READ | PROT_WRITE, flags, fd, 0);
+	if(p == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+	return p;
+}
+static void dict_unmap(zf_ctx *ctx)
+{
+#if ZF_ENABLE_EXTERNAL_DICT
+	munmap(ctx->dict, ZF_DICT_SIZE);
+#endif
+}
 
-	/* Parse command line options */
 
-	while((c = getopt(argc, argv, "hl:tq")) != -1) {
-		switch(c) {
-			case 't':
-				trace = 1;
-				break;
-			case 'l':
-				fname_load = optarg;
-				break;
-			case 'h':
-				usage();
-				exit(0);
-			case 'q':
-				quiet = 1;
-				break;
-		}
+static struct session *session_new(int fd_in, int fd_out, uint8_t *dict)
+{
+	struct session *s = calloc(1, sizeof(*s));
+	if(s == NULL) {
+		perror("calloc");
+		exit(1);
 	}
-	
-	argc -= optind;
-	argv += optind;
+#if ZF_ENABLE_EXTERNAL_DICT
+	s->ctx.dict = dict;
+#else
+	memcpy(s->ctx.dict, dict, ZF_DICT_SIZE);
+	munmap(dict, ZF_DICT_SIZE);
+#endif
+	s->fd_in = fd_in;
+	s->fd_out = fd_out;
+	if(fd_out == STDOUT_FILENO) {
+		output_callback(&s->out, stdio_write, stdout, isatty(fd_out));
+	} else {
+		output_fd(&s->out, fd_out, 0);
+	}
+	return s;
+}
 
-	zf_ctx *ctx = malloc(sizeof(zf_ctx));
-	printf("%p\n", (void *)ctx);
 
-	/* Initialize zforth */
+static void register_natives(zf_ctx *ctx);
+static void profile_free(struct profile *p);
 
-	zf_init(ctx, trace);
+static void session_boot(struct session *s)
+{
+	int i;
 
+	zf_init(&s->ctx, trace);
+#if ZF_ENABLE_PRIM_STATS
+	if(&s->ctx == stats_ctx) {
+		zf_prim_stats(&s->ctx, stats);
+	}
+#endif
 
 	/* Load dict from disk if requested, otherwise bootstrap fort
 	 * dictionary */
 
 	if(fname_load) {
-		load(ctx, fname_load);
+		load(&s->ctx, fname_load);
 	} else {
-		zf_bootstrap(ctx);
+		zf_bootstrap(&s->ctx);
 	}
 
+	register_natives(&s->ctx);
 
 	/* Include files from command line */
 
-	for(i=0; i<argc; i++) {
-		include(ctx, argv[i]);
+	s->depth ++;
+	for(i=0; i<nsrcs; i++) {
+		include(&s->ctx, srcs[i]);
 	}
+	s->depth --;
+}
 
-	if(!quiet) {
-		zf_cell here;
-		zf_uservar_get(ctx, ZF_USERVAR_HERE, &here);
-		printf("Welcome to zForth, %d bytes used\n", (int)here);
+
+static void session_close(struct session *s)
+{
+	close(s->fd_in);
+	if(s->fd_out != s->fd_in) close(s->fd_out);
+	zf_free(&s->ctx);
+	profile_free(s->prof);
+	dict_unmap(&s->ctx);
+	free(s);
+}
+
+
+/*
+ * Run a session until it is parked, spends its budget or finishes a line.
+ * Input is read and evaluated line by line.
+ */
+
+static void session_run(struct session *s)
+{
+	zf_result rv;
+	ssize_t n;
+	char *nl;
+
+	s->parked = 0;
+
+	/* Input is only read between lines, so a session running a long line
+	 * checks for its peer on each slice. Nobody is left to see the result
+	 * of a dead session, whether it is busy or not */
+
+	if(s->busy && s->async && hung_up(s->fd_in)) {
+		s->dead = 1;
+	}
+	if(s->dead) {
+		session_close(s);
+		return;
+	}
+
+	if(!s->busy && s->out.len > 0) {
+		if(output_flush(&s->out) == -1) {
+			park(s, s->fd_out, POLLOUT);
+			return;
+		}
+	}
+
+	if(s->busy) {
+		rv = zf_run_slice(&s->ctx, SESSION_SLICE);
+	} else if(s->quit) {
+		session_close(s);
+		return;
+	} else if((nl = memchr(s->in, '\n', s->in_len)) != NULL || s->in_len == sizeof(s->in)) {
+		size_t len = nl ? (size_t)(nl - s->in) + 1 : s->in_len;
+		if(len == sizeof(s->cmd)) len --;
+		memcpy(s->cmd, s->in, len);
+		s->cmd[len] = '\0';
+		memmove(s->in, s->in + len, s->in_len - len);
+		s->in_len -= len;
+		s->busy = 1;
+		rv = zf_eval_slice(&s->ctx, s->cmd, SESSION_SLICE);
+	} else {
+		n = read(s->fd_in, s->in + s->in_len, sizeof(s->in) - s->in_len);
+		if(n > 0) {
+			s->in_len += n;
+			ready(s);
+		} else if(n < 0 && (errno == EAGAIN || errno == EINTR)) {
+			park(s, s->fd_in, POLLIN);
+		} else {
+			s->dead = 1;
+			session_close(s);
+		}
+		return;
+	}
+
+	if(rv == ZF_YIELD) {
+		if(!s->parked) ready(s);
+		return;
+	}
+
+	s->busy = 0;
+	report(s, NULL, 0, rv);
+	s->depth ++;
+	output(s, "\n", 1);
+	s->depth --;
+	ready(s);
+}
+
+
+/*
+ * Accept connections on the listening socket, each gets its own session
+ * cloned from the booted template session
+ */
+
+static void server_accept(int fd_listen, struct session *template, int dict_fd)
+{
+	int fd;
+
+	while((fd = accept4(fd_listen, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+		struct session *s = session_new(fd, fd, dict_map(dict_fd, MAP_PRIVATE));
+#if ZF_ENABLE_EXTERNAL_DICT
+		zf_clone_mapped(&s->ctx, &template->ctx, s->ctx.dict);
+#else
+		zf_clone(&s->ctx, &template->ctx);
+#endif
+		s->async = 1;
+		ready(s);
+	}
+}
+
+
+/*
+ * Serve sessions on a TCP port on the loopback interface
+ */
+
+static int server(int port)
+{
+	struct sockaddr_in sa;
+	struct epoll_event ev[64];
+	struct session *template;
+	int dict_fd = memfd_create("zforth-dict", MFD_CLOEXEC);
+	int one = 1;
+	int i, n;
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(port);
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if(fd == -1 ||
+	   setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) == -1 ||
+	   bind(fd, (struct sockaddr *)&sa, sizeof(sa)) == -1 ||
+	   listen(fd, SOMAXCONN) == -1) {
+		perror("listen");
+		return 1;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	/* Boot once, new sessions start from a copy of this one. The template
+	 * does not run after booting, so its dictionary stays as the sessions
+	 * mapped it */
+
+	if(dict_fd == -1 || ftruncate(dict_fd, ZF_DICT_SIZE) == -1) {
+		perror("memfd_create");
+		return 1;
+	}
+
+	template = session_new(STDIN_FILENO, STDOUT_FILENO, dict_map(dict_fd, MAP_SHARED));
+	session_boot(template);
+	flush(template);
+
+	ev[0].events = EPOLLIN;
+	ev[0].data.ptr = NULL;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev[0]);
+
+	for(;;) {
+		struct session *s = ready_head;
+		ready_head = ready_tail = NULL;
+
+		/* Run all sessions that were ready at the start of this round */
+
+		while(s) {
+			struct session *next = s->next;
+			session_run(s);
+			s = next;
+		}
+
+		n = epoll_wait(epfd, ev, 64, ready_head ? 0 : -1);
+
+		for(i=0; i<n; i++) {
+			if(ev[i].data.ptr) {
+				if(ev[i].events & (EPOLLHUP | EPOLLRDHUP | EPOLLERR)) {
+					SESSION(ev[i].data.ptr)->dead = 1;
+				}
+				ready(ev[i].data.ptr);
+			} else {
+				server_accept(fd, template, dict_fd);
+			}
+		}
+	}
+
+	return 0;
+}
+
+
+/*
+ * Sys callback function
+ */
+
+/*
+ * Get a pointer to a dictionary range from the stack, aborting when it is out
+ * of bounds
+ */
+
+static uint8_t *dict_range(zf_ctx *ctx, zf_cell addr, zf_cell len)
+{
+	if(len < 0 || addr < 0 || addr >= ZF_DICT_SIZE - len) {
+		zf_abort(ctx, ZF_ABORT_OUTSIDE_MEM);
+	}
+	return (uint8_t *)zf_dump(ctx, NULL) + (int)addr;
+}
+
+
+/*
+ * Host functions, bound to native words and reachable through 'sys' by their
+ * id. Calls that may wait for I/O peek at their arguments and only pop them
+ * when done, so they can return ZF_INPUT_PENDING and be called again.
+ */
+
+static zf_input_state sys_emit(zf_ctx *ctx, const char *input)
+{
+	char c = (char)zf_pick(ctx, 0);
+	if(output(SESSION(ctx), &c, 1)) return ZF_INPUT_PENDING;
+	zf_pop(ctx);
+	return ZF_INPUT_INTERPRET;
+}
+
+/*
+ * Format a cell followed by a space. Integral values, the common case, are
+ * converted directly; the range is limited to where the result is the same
+ * as with ZF_CELL_FMT. NaN and infinities are checked first, converting
+ * them to long is undefined.
+ */
+
+static int format_cell(char *buf, size_t size, zf_cell v)
+{
+	char tmp[24];
+	int i = sizeof(tmp), len = 0;
+	unsigned long u;
+
+	if(isnan(v)) {
+		return snprintf(buf, size, "nan ");
+	}
+	if(isinf(v)) {
+		return snprintf(buf, size, v < 0 ? "-inf " : "inf ");
+	}
+	if(v == 0 || v <= -1e14 || v >= 1e14 || v != (long)v) {
+		return snprintf(buf, size, ZF_CELL_FMT " ", v);
+	}
+
+	u = v < 0 ? -(long)v : (long)v;
+	while(u) {
+		tmp[--i] = '0' + u % 10;
+		u /= 10;
+	}
+	if(v < 0) buf[len++] = '-';
+	memcpy(buf + len, tmp + i, sizeof(tmp) - i);
+	len += sizeof(tmp) - i;
+	buf[len++] = ' ';
+	buf[len] = '\0';
+	return len;
+}
+
+static zf_input_state sys_print(zf_ctx *ctx, const char *input)
+{
+	char buf[32];
+	int len = format_cell(buf, sizeof(buf), zf_pick(ctx, 0));
+	if(output(SESSION(ctx), buf, len)) return ZF_INPUT_PENDING;
+	zf_pop(ctx);
+	return ZF_INPUT_INTERPRET;
+}
+
+static zf_input_state sys_tell(zf_ctx *ctx, const char *input)
+{
+	zf_cell len = zf_pick(ctx, 0);
+	uint8_t *buf = dict_range(ctx, zf_pick(ctx, 1), len);
+	if(output(SESSION(ctx), (char *)buf, len)) return ZF_INPUT_PENDING;
+	zf_pop(ctx);
+	zf_pop(ctx);
+	return ZF_INPUT_INTERPRET;
+}
+
+static zf_input_state sys_quit(zf_ctx *ctx, const char *input)
+{
+	if(SESSION(ctx)->async) {
+		SESSION(ctx)->quit = 1;
+		return ZF_INPUT_INTERPRET;
+	}
+	SESSION(ctx)->impure = 1;
+	flush(SESSION(ctx));
+	printf("\n");
+	exit(0);
+}
+
+static zf_input_state sys_sin(zf_ctx *ctx, const char *input)
+{
+	zf_push(ctx, sin(zf_pop(ctx)));
+	return ZF_INPUT_INTERPRET;
+}
+
+static zf_input_state sys_include(zf_ctx *ctx, const char *input)
+{
+	char fname[256];
+	if(input == NULL) {
+		return ZF_INPUT_PASS_WORD;
+	}
+	/* The included lines reuse the buffer holding the name */
+	snprintf(fname, sizeof(fname), "%s", input);
+	SESSION(ctx)->impure = 1;
+	SESSION(ctx)->depth ++;
+	include(ctx, fname);
+	SESSION(ctx)->depth --;
+	return ZF_INPUT_INTERPRET;
+}
+
+static zf_input_state sys_save(zf_ctx *ctx, const char *input)
+{
+	SESSION(ctx)->impure = 1;
+	save(ctx, "zforth.save");
+	return ZF_INPUT_INTERPRET;
+}
+
+#if ZF_ENABLE_ANALYZE
+static zf_input_state sys_effect(zf_ctx *ctx, const char *input)
+{
+	char buf[64];
+	int len = format_effect(ctx, zf_pick(ctx, 0), buf, sizeof(buf));
+	if(output(SESSION(ctx), buf, len)) return ZF_INPUT_PENDING;
+	zf_pop(ctx);
+	return ZF_INPUT_INTERPRET;
+}
+#endif
+
+static zf_input_state fd_io(zf_ctx *ctx, int reading)
+{
+	int fd = zf_pick(ctx, 0);
+	zf_cell len = zf_pick(ctx, 1);
+	uint8_t *buf = dict_range(ctx, zf_pick(ctx, 2), len);
+	ssize_t n;
+	SESSION(ctx)->impure = 1;
+	if(flush(SESSION(ctx))) return ZF_INPUT_PENDING;
+	if(wait_fd(SESSION(ctx), fd, reading ? POLLIN : POLLOUT)) return ZF_INPUT_PENDING;
+	n = reading ? read(fd, buf, len) : write(fd, buf, len);
+	zf_pop(ctx);
+	zf_pop(ctx);
+	zf_pop(ctx);
+	zf_push(ctx, n);
+	return ZF_INPUT_INTERPRET;
+}
+
+static zf_input_state sys_fd_read(zf_ctx *ctx, const char *input)
+{
+	return fd_io(ctx, 1);
+}
+
+static zf_input_state sys_fd_write(zf_ctx *ctx, const char *input)
+{
+	return fd_io(ctx, 0);
+}
+
+static zf_input_state sys_fd_in(zf_ctx *ctx, const char *input)
+{
+	SESSION(ctx)->impure = 1;
+	zf_push(ctx, SESSION(ctx)->fd_in);
+	return ZF_INPUT_INTERPRET;
+}
+
+static zf_input_state sys_fd_out(zf_ctx *ctx, const char *input)
+{
+	SESSION(ctx)->impure = 1;
+	zf_push(ctx, SESSION(ctx)->fd_out);
+	return ZF_INPUT_INTERPRET;
+}
+
+static zf_input_state sys_flush(zf_ctx *ctx, const char *input)
+{
+	if(flush(SESSION(ctx))) return ZF_INPUT_PENDING;
+	return ZF_INPUT_INTERPRET;
+}
+
+
+/*
+ * Message queues between contexts in different threads. Queues are shared
+ * by all threads and referred to by their index + 1; they live until the
+ * process exits. A full queue makes the sender yield, an empty queue makes
+ * the receiver wait for its eventfd; async sessions go back to the event loop
+ * in both cases. Messages must be received the way they were sent: a cell
+ * with q@, a block with q-recv.
+ */
+
+#define QUEUE_MAX 64
+
+static struct queue *_Atomic queues[QUEUE_MAX];
+static atomic_int queue_next = 0;
+
+static struct queue *queue_arg(zf_ctx *ctx, zf_cell id)
+{
+	int i = (int)id - 1;
+	struct queue *q = (i >= 0 && i < QUEUE_MAX) ? queues[i] : NULL;
+	if(q == NULL) {
+		zf_abort(ctx, ZF_ABORT_OUTSIDE_MEM);
+	}
+	return q;
+}
+
+static zf_input_state queue_create(zf_ctx *ctx, int multi)
+{
+	zf_cell size = zf_pop(ctx);
+	struct queue *q;
+	int i;
+
+	if(!(size >= 1 && size <= 1 << 20)) {
+		zf_abort(ctx, ZF_ABORT_INVALID_SIZE);
+	}
+	q = queue_new((size_t)size, multi);
+	if(q == NULL) {
+		zf_abort(ctx, ZF_ABORT_OUTSIDE_MEM);
+	}
+
+	/* Only a created queue takes an id, and only while there is one */
+
+	i = atomic_load(&queue_next);
+	do {
+		if(i >= QUEUE_MAX) {
+			queue_free(q);
+			zf_abort(ctx, ZF_ABORT_OUTSIDE_MEM);
+		}
+	} while(!atomic_compare_exchange_weak(&queue_next, &i, i + 1));
+	queues[i] = q;
+	zf_push(ctx, i + 1);
+	return ZF_INPUT_INTERPRET;
+}
+
+/* Returns nonzero when the sender should retry later from the event loop */
+
+static int queue_full(struct session *s)
+{
+	if(s->async && s->depth == 0) {
+		return 1;
+	}
+	sched_yield();
+	return 0;
+}
+
+static int queue_wait(struct session *s, struct queue *q, zf_cell *head)
+{
+	while(!queue_peek(q, head)) {
+		if(flush(s)) return 1;
+		if(queue_sleep(q) && wait_fd(s, q->efd, POLLIN)) return 1;
+	}
+	return 0;
+}
+
+static zf_input_state sys_queue(zf_ctx *ctx, const char *input)
+{
+	return queue_create(ctx, 0);
+}
+
+static zf_input_state sys_mqueue(zf_ctx *ctx, const char *input)
+{
+	return queue_create(ctx, 1);
+}
+
+static zf_input_state sys_q_put(zf_ctx *ctx, const char *input)
+{
+	struct queue *q = queue_arg(ctx, zf_pick(ctx, 0));
+	while(!queue_put(q, zf_pick(ctx, 1), NULL, 0)) {
+		if(queue_full(SESSION(ctx))) return ZF_INPUT_PENDING;
+	}
+	zf_pop(ctx);
+	zf_pop(ctx);
+	return ZF_INPUT_INTERPRET;
+}
+
+static zf_input_state sys_q_get(zf_ctx *ctx, const char *input)
+{
+	struct queue *q = queue_arg(ctx, zf_pick(ctx, 0));
+	zf_cell v;
+	if(queue_wait(SESSION(ctx), q, &v)) return ZF_INPUT_PENDING;
+	queue_take(q, NULL, 0, 0);
+	zf_pop(ctx);
+	zf_push(ctx, v);
+	return ZF_INPUT_INTERPRET;
+}
+
+static zf_input_state sys_q_send(zf_ctx *ctx, const char *input)
+{
+	struct queue *q = queue_arg(ctx, zf_pick(ctx, 0));
+	zf_cell len = zf_pick(ctx, 1);
+	uint8_t *buf = dict_range(ctx, zf_pick(ctx, 2), len);
+	int r;
+	while((r = queue_put(q, len, buf, len)) == 0) {
+		if(queue_full(SESSION(ctx))) return ZF_INPUT_PENDING;
+	}
+	if(r == -1) {
+		zf_abort(ctx, ZF_ABORT_INVALID_SIZE);
+	}
+	zf_pop(ctx);
+	zf_pop(ctx);
+	zf_pop(ctx);
+	return ZF_INPUT_INTERPRET;
+}
+
+static zf_input_state sys_q_recv(zf_ctx *ctx, const char *input)
+{
+	struct queue *q = queue_arg(ctx, zf_pick(ctx, 0));
+	zf_cell len = zf_pick(ctx, 1);
+	uint8_t *buf = dict_range(ctx, zf_pick(ctx, 2), len);
+	zf_cell size;
+	if(queue_wait(SESSION(ctx), q, &size)) return ZF_INPUT_PENDING;
+	if(size < 0 || QUEUE_CELLS((size_t)size) >= q->size) {
+		zf_abort(ctx, ZF_ABORT_INVALID_SIZE);
+	}
+	queue_take(q, buf, len, size);
+	zf_pop(ctx);
+	zf_pop(ctx);
+	zf_pop(ctx);
+	zf_push(ctx, size);
+	return ZF_INPUT_INTERPRET;
+}
+
+static zf_input_state sys_q_count(zf_ctx *ctx, const char *input)
+{
+	struct queue *q = queue_arg(ctx, zf_pick(ctx, 0));
+	zf_pop(ctx);
+	zf_push(ctx, queue_count(q));
+	return ZF_INPUT_INTERPRET;
+}
+
+
+/*
+ * Sessions for other threads run on a copy of the dictionary with empty
+ * stacks. They are sync sessions writing to stdout, and share no memory with
+ * their parent but the queues.
+ */
+
+static struct session *session_fork(zf_ctx *ctx)
+{
+	struct session *s = session_new(-1, STDOUT_FILENO,
+			dict_map(-1, MAP_PRIVATE | MAP_ANONYMOUS));
+	zf_init(&s->ctx, trace);
+	memcpy(s->ctx.dict, zf_dump(ctx, NULL), ZF_DICT_SIZE);
+	zf_uservar_set(&s->ctx, ZF_USERVAR_DSP, 0);
+	zf_uservar_set(&s->ctx, ZF_USERVAR_RSP, 0);
+	zf_uservar_set(&s->ctx, ZF_USERVAR_PROFILE, 0);
+	register_natives(&s->ctx);
+	return s;
+}
+
+static void session_free(struct session *s)
+{
+	zf_free(&s->ctx);
+	profile_free(s->prof);
+	dict_unmap(&s->ctx);
+	free(s);
+}
+
+static pthread_t thread_start(void *(*fn)(void *), void *arg)
+{
+	pthread_t t;
+	if(pthread_create(&t, NULL, fn, arg) != 0) {
+		perror("pthread_create");
+		exit(1);
+	}
+	return t;
+}
+
+
+/*
+ * 'thread name' runs a word in a new thread
+ */
+
+static void *thread_main(void *arg)
+{
+	struct session *s = arg;
+	do_eval(&s->ctx, NULL, 0, s->cmd);
+	session_free(s);
+	return NULL;
+}
+
+static zf_input_state sys_thread(zf_ctx *ctx, const char *input)
+{
+	struct session *s;
+
+	if(input == NULL) {
+		return ZF_INPUT_PASS_WORD;
+	}
+
+	SESSION(ctx)->impure = 1;
+	s = session_fork(ctx);
+	snprintf(s->cmd, sizeof(s->cmd), "%s", input);
+	pthread_detach(thread_start(thread_main, s));
+	return ZF_INPUT_INTERPRET;
+}
+
+
+/*
+ * 'par-map ( xt addr n size -- )' calls xt ( addr -- ) for each of the n
+ * elements of 'size' bytes at addr, in worker threads, and copies the
+ * elements back to the dictionary of the caller. Each worker runs on its own
+ * copy of the dictionary, so everything else the xt writes is lost. The
+ * elements are split evenly over the workers; a worker which runs out takes
+ * half of the remaining range of the busiest one. A range is a packed pair
+ * of 32 bit indices, changed with compare-and-swap by both its owner and the
+ * thieves.
+ */
+
+#define PAR_WORKERS 16
+
+struct par_worker {
+	struct session *s;
+	_Atomic uint64_t range;         /* next << 32 | end */
+	struct par_map *map;
+	pthread_t thread;
+};
+
+struct par_map {
+	zf_addr xt;
+	zf_addr addr;
+	zf_addr size;
+	uint32_t grain;                 /* elements taken at once */
+	uint8_t *dict;                  /* of the caller */
+	atomic_int result;              /* first abort reason */
+	int count;
+	struct par_worker worker[PAR_WORKERS];
+};
+
+#define PAR_RANGE(next, end) ((uint64_t)(next) << 32 | (end))
+
+static int par_take(struct par_worker *w, uint32_t *next, uint32_t *end)
+{
+	uint64_t r = atomic_load(&w->range);
+	uint32_t n, e;
+
+	do {
+		n = r >> 32;
+		e = r & 0xffffffff;
+		if(n >= e) return 0;
+		*next = n;
+		*end = e - n > w->map->grain ? n + w->map->grain : e;
+	} while(!atomic_compare_exchange_weak(&w->range, &r, PAR_RANGE(*end, e)));
+
+	return 1;
+}
+
+static int par_steal(struct par_worker *w)
+{
+	struct par_map *m = w->map;
+	int i;
+
+	for(;;) {
+		struct par_worker *victim = NULL;
+		uint64_t r, best = 0;
+		uint32_t n, e, mid;
+
+		for(i=0; i<m->count; i++) {
+			r = atomic_load(&m->worker[i].range);
+			n = r >> 32;
+			e = r & 0xffffffff;
+			if(n < e && e - n > best) {
+				best = e - n;
+				victim = &m->worker[i];
+			}
+		}
+		if(victim == NULL) {
+			return 0;
+		}
+
+		r = atomic_load(&victim->range);
+		n = r >> 32;
+		e = r & 0xffffffff;
+		if(n >= e) continue;
+		mid = n + (e - n) / 2;
+		if(atomic_compare_exchange_strong(&victim->range, &r, PAR_RANGE(n, mid))) {
+			atomic_store(&w->range, PAR_RANGE(mid, e));
+			return 1;
+		}
+	}
+}
+
+static void *par_main(void *arg)
+{
+	struct par_worker *w = arg;
+	struct par_map *m = w->map;
+	zf_ctx *ctx = &w->s->ctx;
+	uint8_t *dict = zf_dump(ctx, NULL);
+	uint32_t i, next, end;
+	zf_result r;
+
+	do {
+		while(par_take(w, &next, &end)) {
+			for(i=next; i<end; i++) {
+				zf_addr a = m->addr + i * m->size;
+				if(atomic_load(&m->result) != ZF_OK) {
+					return NULL;
+				}
+				zf_push(ctx, a);
+				r = zf_call(ctx, m->xt);
+				zf_uservar_set(ctx, ZF_USERVAR_DSP, 0);
+				if(r != ZF_OK) {
+					atomic_compare_exchange_strong(&m->result, &(int){ ZF_OK }, r);
+					return NULL;
+				}
+				memcpy(m->dict + a, dict + a, m->size);
+			}
+		}
+	} while(par_steal(w));
+
+	return NULL;
+}
+
+static zf_input_state sys_par_map(zf_ctx *ctx, const char *input)
+{
+	struct par_map *m;
+	zf_cell size = zf_pick(ctx, 0);
+	zf_cell len = zf_pick(ctx, 1);
+	zf_cell addr = zf_pick(ctx, 2);
+	zf_addr xt = zf_pick(ctx, 3);
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	uint32_t n;
+	int i, count;
+	zf_result r;
+
+	if(size < 1 || len < 0 || len * size >= ZF_DICT_SIZE) {
+		zf_abort(ctx, ZF_ABORT_INVALID_SIZE);
+	}
+	dict_range(ctx, addr, len * size);
+	for(i=0; i<4; i++) zf_pop(ctx);
+	n = len;
+	if(n == 0) {
+		return ZF_INPUT_INTERPRET;
+	}
+
+	m = calloc(1, sizeof(*m));
+	if(m == NULL) {
+		zf_abort(ctx, ZF_ABORT_OUTSIDE_MEM);
+	}
+
+	count = cpus < 1 ? 1 : cpus > PAR_WORKERS ? PAR_WORKERS : cpus;
+	if((uint32_t)count > n) count = n;
+
+	SESSION(ctx)->impure = 1;
+	flush(SESSION(ctx));
+	m->xt = xt;
+	m->addr = addr;
+	m->size = size;
+	m->dict = zf_dump(ctx, NULL);
+	m->count = count;
+	m->grain = n / count / 16 + 1;
+
+	for(i=0; i<count; i++) {
+		struct par_worker *w = &m->worker[i];
+		w->s = session_fork(ctx);
+		w->map = m;
+		atomic_store(&w->range, PAR_RANGE(n * i / count, n * (i + 1) / count));
+	}
+	for(i=0; i<count; i++) {
+		m->worker[i].thread = thread_start(par_main, &m->worker[i]);
+	}
+	for(i=0; i<count; i++) {
+		pthread_join(m->worker[i].thread, NULL);
+		flush(m->worker[i].s);
+		session_free(m->worker[i].s);
+	}
+
+	r = atomic_load(&m->result);
+	free(m);
+	if(r != ZF_OK) {
+		zf_abort(ctx, r);
+	}
+	return ZF_INPUT_INTERPRET;
+}
+
+
+/*
+ * Profiling with the performance counters of the thread, see
+ * perf_event_open(2). 'profile ( flag -- )' starts or stops profiling the
+ * session, '.profile' prints the counts and resets them. The counters are
+ * read before every instruction, and the difference to the previous reading
+ * is charged to the previous instruction, so primitives and native words get
+ * their own cost. Words get their cost from call to return, which is when
+ * the return stack is back to the depth of the call. Time spent outside the
+ * inner interpreter is not counted. The task clock is always there, the
+ * hardware counters only when the CPU and the kernel provide them; these
+ * leave out the kernel, and with it the reading itself.
+ */
+
+#define PROF_COUNTERS 5
+#define PROF_DEPTH 256
+
+static const struct {
+	uint32_t type;
+	uint64_t config;
+	const char *name;
+} prof_events[PROF_COUNTERS] = {
+	{ PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK,    "ns" },
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES,    "cycles" },
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS,  "instr" },
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, "br-miss" },
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES,  "cache-miss" },
+};
+
+struct prof_frame {
+	zf_addr xt;
+	zf_addr rsp;                    /* return stack depth of the call */
+	uint64_t start[PROF_COUNTERS];
+};
+
+struct profile {
+	int fd;                         /* group leader, the task clock */
+	int count;                      /* counters opened */
+	int event[PROF_COUNTERS];       /* prof_events index of each counter */
+	int stopped;                    /* outside the inner interpreter */
+	zf_addr last;                   /* running instruction, or ZF_PROFILE_STOP */
+	uint64_t idle[PROF_COUNTERS];   /* counted while stopped */
+	uint64_t prev[PROF_COUNTERS];
+	int depth;
+	struct prof_frame frame[PROF_DEPTH];
+	uint64_t calls[ZF_DICT_SIZE];
+	uint64_t cost[ZF_DICT_SIZE][PROF_COUNTERS];
+	uint8_t word[ZF_DICT_SIZE];     /* called, not a primitive */
+	char *report;                   /* '.profile' output not yet written */
+};
+
+static struct profile *profile_open(void)
+{
+	struct profile *p = calloc(1, sizeof(*p));
+	int i, fd;
+
+	if(p == NULL) {
+		return NULL;
+	}
+	p->fd = -1;
+	for(i=0; i<PROF_COUNTERS; i++) {
+		struct perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = prof_events[i].type;
+		attr.config = prof_events[i].config;
+		attr.read_format = PERF_FORMAT_GROUP;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		fd = syscall(SYS_perf_event_open, &attr, 0, -1, p->fd, 0);
+		if(fd == -1) {
+			if(i == 0) {
+				perror("perf_event_open");
+				free(p);
+				return NULL;
+			}
+			continue;
+		}
+		if(i == 0) p->fd = fd;
+		p->event[p->count++] = i;
+	}
+	p->stopped = 1;
+	p->last = ZF_PROFILE_STOP;
+	return p;
+}
+
+static void profile_free(struct profile *p)
+{
+	if(p) {
+		close(p->fd);
+		free(p->report);
+		free(p);
+	}
+}
+
+/* Read the counters, leaving out what was counted while stopped */
+
+static void profile_read(struct profile *p, uint64_t *v)
+{
+	uint64_t buf[PROF_COUNTERS + 1];
+	int i;
+
+	if(read(p->fd, buf, sizeof(buf)) < (ssize_t)sizeof(uint64_t)) {
+		memcpy(v, p->prev, sizeof(p->prev));
+		return;
+	}
+	for(i=0; i<p->count; i++) {
+		v[i] = buf[i + 1];
+	}
+	if(p->stopped) {
+		for(i=0; i<p->count; i++) {
+			p->idle[i] = v[i] - p->prev[i];
+		}
+		p->stopped = 0;
+	}
+	for(i=0; i<p->count; i++) {
+		v[i] -= p->idle[i];
+	}
+}
+
+void zf_host_profile(zf_ctx *ctx, zf_addr op, zf_addr rsp, int call)
+{
+	struct profile *p = SESSION(ctx)->prof;
+	uint64_t now[PROF_COUNTERS];
+	int i;
+
+	if(p == NULL) {
+		return;
+	}
+	profile_read(p, now);
+
+	if(p->last != ZF_PROFILE_STOP) {
+		for(i=0; i<p->count; i++) {
+			p->cost[p->last][i] += now[i] - p->prev[i];
+		}
+	}
+
+	/* Words which returned, or were left by an abort or throw */
+
+	while(p->depth > 0 && p->frame[p->depth-1].rsp >= rsp) {
+		struct prof_frame *f = &p->frame[--p->depth];
+		for(i=0; i<p->count; i++) {
+			p->cost[f->xt][i] += now[i] - f->start[i];
+		}
+	}
+
+	p->last = ZF_PROFILE_STOP;
+	if(op == ZF_PROFILE_STOP) {
+		p->stopped = 1;
+	} else if(op < ZF_DICT_SIZE) {
+		p->calls[op] ++;
+		p->word[op] = call;
+		if(!call) {
+			p->last = op;
+		} else if(p->depth < PROF_DEPTH) {
+			struct prof_frame *f = &p->frame[p->depth++];
+			f->xt = op;
+			f->rsp = rsp;
+			memcpy(f->start, now, sizeof(now));
+		}
+	}
+	memcpy(p->prev, now, sizeof(now));
+}
+
+static zf_input_state sys_profile(zf_ctx *ctx, const char *input)
+{
+	struct session *s = SESSION(ctx);
+	zf_cell on = zf_pop(ctx);
+
+	if(on && s->prof == NULL) {
+		s->prof = profile_open();
+		if(s->prof == NULL) {
+			zf_abort(ctx, ZF_ABORT_EXTERNAL);
+		}
+	}
+	if(s->prof) {
+		s->prof->stopped = 1;
+		s->prof->last = ZF_PROFILE_STOP;
+		s->prof->depth = 0;
+	}
+	zf_uservar_set(ctx, ZF_USERVAR_PROFILE, on != 0);
+	return ZF_INPUT_INTERPRET;
+}
+
+static int profile_cmp(const void *a, const void *b)
+{
+	const uint64_t *x = *(const uint64_t **)a;
+	const uint64_t *y = *(const uint64_t **)b;
+	return *y > *x ? 1 : *y < *x ? -1 : 0;
+}
+
+/* Instructions by cost, most expensive first. Primitives and native words
+ * are in parentheses, like in traces */
+
+static char *profile_report(zf_ctx *ctx, struct profile *p)
+{
+	uint64_t **order = malloc(ZF_DICT_SIZE * sizeof(*order));
+	char *buf = NULL;
+	size_t size = 0;
+	FILE *f = open_memstream(&buf, &size);
+	int i, j, n = 0;
+
+	if(order == NULL || f == NULL) {
+		free(order);
+		if(f) fclose(f);
+		free(buf);
+		return NULL;
+	}
+	for(i=0; i<ZF_DICT_SIZE; i++) {
+		if(p->calls[i]) order[n++] = p->cost[i];
+	}
+	qsort(order, n, sizeof(*order), profile_cmp);
+
+	fprintf(f, "%-16s %10s", "word", "calls");
+	for(j=0; j<p->count; j++) {
+		fprintf(f, " %12s", prof_events[p->event[j]].name);
+	}
+	fprintf(f, "\n");
+	for(i=0; i<n; i++) {
+		zf_addr op = (order[i] - p->cost[0]) / PROF_COUNTERS;
+		char name[32];
+		snprintf(name, sizeof(name), p->word[op] ? "%s" : "(%s)", zf_op_name(ctx, op, 1));
+		fprintf(f, "%-16s %10" PRIu64, name, p->calls[op]);
+		for(j=0; j<p->count; j++) {
+			fprintf(f, " %12" PRIu64, order[i][j]);
+		}
+		fprintf(f, "\n");
+	}
+	fclose(f);
+	free(order);
+	return buf;
+}
+
+static zf_input_state sys_dot_prof(zf_ctx *ctx, const char *input)
+{
+	struct profile *p = SESSION(ctx)->prof;
+
+	if(p == NULL) {
+		return ZF_INPUT_INTERPRET;
+	}
+	if(p->report == NULL) {
+		p->report = profile_report(ctx, p);
+		if(p->report == NULL) {
+			zf_abort(ctx, ZF_ABORT_OUTSIDE_MEM);
+		}
+	}
+	if(output(SESSION(ctx), p->report, strlen(p->report))) {
+		return ZF_INPUT_PENDING;
+	}
+	free(p->report);
+	p->report = NULL;
+	memset(p->calls, 0, sizeof(p->calls));
+	memset(p->cost, 0, sizeof(p->cost));
+	p->depth = 0;
+	return ZF_INPUT_INTERPRET;
+}
+
+
+/*
+ * How host functions are logged. Live functions run again when replaying,
+ * the others are replaced by their recorded result cells, and the bytes
+ * they read into the dictionary.
+ */
+
+typedef enum {
+	LOG_LIVE,
+	LOG_RESULT,
+	LOG_BUFFER,             /* ( addr len x -- n ) reads n bytes to addr */
+	LOG_WORD                /* result, after reading a word of input */
+} log_mode;
+
+static const struct host_fn {
+	zf_syscall_id id;
+	const char *name;
+	zf_native_fn fn;
+	int din, dout;
+	log_mode log;
+} host_fns[] = {
+	{ ZF_SYSCALL_EMIT,      "emit",     sys_emit,     1, 0, LOG_LIVE },
+	{ ZF_SYSCALL_PRINT,     ".",        sys_print,    1, 0, LOG_LIVE },
+	{ ZF_SYSCALL_TELL,      "tell",     sys_tell,     2, 0, LOG_LIVE },
+	{ ZF_SYSCALL_USER + 0,  "quit",     sys_quit,     0, 0, LOG_LIVE },
+	{ ZF_SYSCALL_USER + 1,  "sin",      sys_sin,      1, 1, LOG_LIVE },
+	{ ZF_SYSCALL_USER + 2,  "include",  sys_include,  0, 0, LOG_LIVE },
+	{ ZF_SYSCALL_USER + 3,  "save",     sys_save,     0, 0, LOG_LIVE },
+#if ZF_ENABLE_ANALYZE
+	{ ZF_SYSCALL_USER + 4,  "effect",   sys_effect,   1, 0, LOG_LIVE },
+#endif
+	{ ZF_SYSCALL_USER + 5,  "fd-read",  sys_fd_read,  3, 1, LOG_BUFFER },
+	{ ZF_SYSCALL_USER + 6,  "fd-write", sys_fd_write, 3, 1, LOG_RESULT },
+	{ ZF_SYSCALL_USER + 7,  "fd-in",    sys_fd_in,    0, 1, LOG_RESULT },
+	{ ZF_SYSCALL_USER + 8,  "fd-out",   sys_fd_out,   0, 1, LOG_RESULT },
+	{ ZF_SYSCALL_USER + 9,  "flush",    sys_flush,    0, 0, LOG_LIVE },
+	{ ZF_SYSCALL_USER + 10, "queue",    sys_queue,    1, 1, LOG_RESULT },
+	{ ZF_SYSCALL_USER + 11, "mqueue",   sys_mqueue,   1, 1, LOG_RESULT },
+	{ ZF_SYSCALL_USER + 12, "q!",       sys_q_put,    2, 0, LOG_RESULT },
+	{ ZF_SYSCALL_USER + 13, "q@",       sys_q_get,    1, 1, LOG_RESULT },
+	{ ZF_SYSCALL_USER + 14, "q-send",   sys_q_send,   3, 0, LOG_RESULT },
+	{ ZF_SYSCALL_USER + 15, "q-recv",   sys_q_recv,   3, 1, LOG_BUFFER },
+	{ ZF_SYSCALL_USER + 16, "q?",       sys_q_count,  1, 1, LOG_RESULT },
+	{ ZF_SYSCALL_USER + 17, "thread",   sys_thread,   0, 0, LOG_WORD },
+	{ ZF_SYSCALL_USER + 18, "par-map",  sys_par_map,  4, 0, LOG_LIVE },
+	{ ZF_SYSCALL_USER + 19, "profile",  sys_profile,  1, 0, LOG_LIVE },
+	{ ZF_SYSCALL_USER + 20, ".profile", sys_dot_prof, 0, 0, LOG_LIVE },
+};
+
+#define HOST_FN_COUNT (sizeof(host_fns) / sizeof(host_fns[0]))
+
+
+static const struct host_fn *host_fn(zf_syscall_id id)
+{
+	size_t i;
+	for(i=0; i<HOST_FN_COUNT; i++) {
+		if(host_fns[i].id == id) return &host_fns[i];
+	}
+	return NULL;
+}
+
+
+/*
+ * Bind all host functions to native words. Logged sessions, and builds
+ * without ZF_ENABLE_NATIVES, leave them to the 'sys' words of core.zf, so
+ * all calls go through zf_host_sys().
+ */
+
+static void register_natives(zf_ctx *ctx)
+{
+#if ZF_ENABLE_NATIVES
+	size_t i;
+	if(rec_file || play_file) {
+		return;
+	}
+	for(i=0; i<HOST_FN_COUNT; i++) {
+		const struct host_fn *f = &host_fns[i];
+		if(zf_register_native(ctx, f->name, f->fn, f->din, f->dout) == -1) {
+			fprintf(stderr, "error registering native word '%s'\n", f->name);
+		}
+	}
+#endif
+}
+
+
+/*
+ * Record a host function which is done, or check that the replay calls the
+ * same live function. Results are logged as the function id, the result
+ * cells from the top of the stack and the bytes read.
+ */
+
+static void log_sys(zf_ctx *ctx, const struct host_fn *f, zf_cell addr, zf_cell len)
+{
+	uint8_t buf[4 + 8 * sizeof(zf_cell) + ZF_DICT_SIZE];
+	uint16_t id = f->id;
+	size_t n = 0;
+	int i;
+
+	if(play_file) {
+		replay_type type;
+		uint16_t *p = replay_get(play_file, &type, &n);
+		if(p == NULL || type != REPLAY_SYS || n < sizeof(id) || *p != id) {
+			log_diverged(f->name);
+		}
+		free(p);
+		return;
+	}
+
+	memcpy(buf, &id, sizeof(id));
+	n += sizeof(id);
+	if(f->log != LOG_LIVE) {
+		for(i=0; i<f->dout; i++) {
+			zf_cell v = zf_pick(ctx, i);
+			memcpy(buf + n, &v, sizeof(v));
+			n += sizeof(v);
+		}
+	}
+	if(f->log == LOG_BUFFER) {
+		zf_cell got = zf_pick(ctx, 0);
+		size_t k = got <= 0 ? 0 : got < len ? (size_t)got : (size_t)len;
+		memcpy(buf + n, dict_range(ctx, addr, k), k);
+		n += k;
+	}
+	replay_put(rec_file, REPLAY_SYS, buf, n);
+}
+
+
+/*
+ * Replace a host function by its recorded results
+ */
+
+static zf_input_state replay_sys(zf_ctx *ctx, const struct host_fn *f, const char *input)
+{
+	replay_type type;
+	uint8_t *p;
+	size_t len, n, k;
+	uint16_t id;
+	zf_cell v, addr = 0, size = 0;
+	int i;
+
+	if(f->log == LOG_WORD && input == NULL) {
+		return ZF_INPUT_PASS_WORD;
+	}
+
+	p = replay_get(play_file, &type, &len);
+	if(p != NULL) memcpy(&id, p, sizeof(id));
+	n = sizeof(id) + f->dout * sizeof(zf_cell);
+	if(p == NULL || type != REPLAY_SYS || len < n || id != f->id) {
+		log_diverged(f->name);
+	}
+
+	if(f->log == LOG_BUFFER) {
+		addr = zf_pick(ctx, 2);
+		size = zf_pick(ctx, 1);
+	}
+	for(i=0; i<f->din; i++) {
+		zf_pop(ctx);
+	}
+	for(i=f->dout-1; i>=0; i--) {
+		memcpy(&v, p + sizeof(id) + i * sizeof(v), sizeof(v));
+		zf_push(ctx, v);
+	}
+	k = len - n;
+	if(f->log == LOG_BUFFER && k <= size) {
+		memcpy(dict_range(ctx, addr, k), p + n, k);
+	}
+
+	free(p);
+	return ZF_INPUT_INTERPRET;
+}
+
+
+/*
+ * Sys callback function
+ */
+
+zf_input_state zf_host_sys(zf_ctx *ctx, zf_syscall_id id, const char *input)
+{
+	const struct host_fn *f = host_fn(id);
+	zf_cell addr = 0, len = 0;
+	zf_input_state rv;
+
+	if(f == NULL) {
+		printf("unhandled syscall %d\n", id);
+		return ZF_INPUT_INTERPRET;
+	}
+
+	if(!SESSION(ctx)->log) {
+		return f->fn(ctx, input);
+	}
+
+	if(play_file && f->log != LOG_LIVE) {
+		return replay_sys(ctx, f, input);
+	}
+
+	if(f->log == LOG_BUFFER) {
+		addr = zf_pick(ctx, 2);
+		len = zf_pick(ctx, 1);
+	}
+	rv = f->fn(ctx, input);
+	if(rv == ZF_INPUT_INTERPRET) {
+		log_sys(ctx, f, addr, len);
+	}
+	return rv;
+}
+
+
+/*
+ * Stack effects of the above system calls, used by zf_analyze()
+ */
+
+int zf_host_sys_effect(zf_ctx *ctx, zf_syscall_id id, int *din, int *dout)
+{
+	const struct host_fn *f = host_fn(id);
+
+	if(f == NULL) {
+		return 0;
+	}
+
+	*din = f->din;
+	*dout = f->dout;
+	return 1;
+}
+
+
+/*
+ * Tracing output
+ */
+
+void zf_host_trace(zf_ctx *ctx, const char *fmt, va_list va)
+{
+	fprintf(stderr, "\033[1;30m");
+	vfprintf(stderr, fmt, va);
+	fprintf(stderr, "\033[0m");
+}
+
+
+/*
+ * Binary trace events of the main session are kept in a ring buffer, which
+ * is written to a file at exit together with the dictionary. The decoder
+ * looks up the names of words in that dictionary to print the events as the
+ * text trace would have.
+ */
+
+#define TRACE_MAGIC 0x3154465a /* "ZFT1" */
+#define TRACE_RING 65536
+
+static zf_trace_event trace_ring[TRACE_RING];
+static uint64_t trace_count = 0;
+static uint64_t trace_start = 0;
+static zf_ctx *trace_ctx = NULL;
+static const char *fname_trace = NULL;
+
+void zf_host_trace_event(zf_ctx *ctx, const zf_trace_event *ev)
+{
+	zf_trace_event *e;
+
+	if(ctx != trace_ctx) {
+		return;
+	}
+
+	e = &trace_ring[trace_count++ % TRACE_RING];
+	*e = *ev;
+	e->time = (now_ns() - trace_start) / 1000;
+}
+
+static void trace_dump(void)
+{
+	uint32_t n = trace_count < TRACE_RING ? trace_count : TRACE_RING;
+	uint32_t first = (trace_count - n) % TRACE_RING;
+	uint32_t hdr[3] = { TRACE_MAGIC, ZF_DICT_SIZE, n };
+	FILE *f = fopen(fname_trace, "wb");
+
+	if(f == NULL) {
+		perror(fname_trace);
+		return;
+	}
+	fwrite(hdr, sizeof(hdr), 1, f);
+	fwrite(zf_dump(trace_ctx, NULL), ZF_DICT_SIZE, 1, f);
+	fwrite(trace_ring + first, sizeof(zf_trace_event), n < TRACE_RING - first ? n : TRACE_RING - first, f);
+	if(n > TRACE_RING - first) {
+		fwrite(trace_ring, sizeof(zf_trace_event), n - (TRACE_RING - first), f);
+	}
+	fclose(f);
+}
+
+static void trace_print(zf_ctx *ctx, const zf_trace_event *ev)
+{
+	static char created[64];
+	unsigned int vi = ev->v;
+	int i;
+
+	switch(ev->type) {
+		case ZF_TRACE_EXEC:
+			printf("\n " ZF_ADDR_FMT " " ZF_ADDR_FMT " ", ev->addr, ev->op);
+			for(i=0; i<ev->rsp; i++) printf("┊  ");
+			break;
+		case ZF_TRACE_CALL: printf("%s/" ZF_ADDR_FMT " ", zf_op_name(ctx, ev->op, 1), ev->op); break;
+		case ZF_TRACE_PRIM: printf("(%s) ", zf_op_name(ctx, ev->op, 1)); break;
+		case ZF_TRACE_ENTER: printf("\n[%s/" ZF_ADDR_FMT "] ", zf_op_name(ctx, ev->op, 1), ev->op); break;
+		case ZF_TRACE_PUSH: printf("»" ZF_CELL_FMT " ", ev->v); break;
+		case ZF_TRACE_POP: printf("«" ZF_CELL_FMT " ", ev->v); break;
+		case ZF_TRACE_RPUSH: printf("r»" ZF_CELL_FMT " ", ev->v); break;
+		case ZF_TRACE_RPOP: printf("r«" ZF_CELL_FMT " ", ev->v); break;
+		case ZF_TRACE_JUMP: printf("ip " ZF_ADDR_FMT "=>" ZF_ADDR_FMT, ev->addr, ev->op); break;
+		case ZF_TRACE_TICK: printf("%s/", zf_op_name(ctx, ev->op, 1)); break;
+		case ZF_TRACE_WRITE:
+			/* Size markers of the variable size encoding, memory
+			 * size 0 is variable, 64 the variable maximum */
+			printf("\n+" ZF_ADDR_FMT " " ZF_ADDR_FMT, ev->addr, (zf_addr)ev->v);
+			if(ev->op == 0 && ev->v - vi == 0 && vi < 128) {
+				printf(" ¹");
+			} else if(ev->op == 0 && ev->v - vi == 0 && vi < 16384) {
+				printf(" ²");
+			} else if(ev->op == 0 || ev->op == 64) {
+				printf(" ⁵");
+			}
+			break;
+		case ZF_TRACE_ADD: printf(" "); break;
+		case ZF_TRACE_OP: printf("+%s ", zf_op_name(ctx, ev->op, 1)); break;
+		case ZF_TRACE_STR: printf("\n+" ZF_ADDR_FMT " " ZF_ADDR_FMT " s '%s'", ev->addr, 0, created); break;
+		case ZF_TRACE_CREATE:
+			snprintf(created, sizeof(created), "%s", zf_op_name(ctx, ev->addr, 0));
+			printf("\n=== create '%s'", created);
+			break;
+		case ZF_TRACE_END: printf("\n==="); break;
+		case ZF_TRACE_SPILL: printf("spill %d ", (int)ev->v); break;
+		case ZF_TRACE_TASK: printf("task %d ", (int)ev->v); break;
+		case ZF_TRACE_CATCH: printf("catch " ZF_CELL_FMT " ", ev->v); break;
+	}
+}
+
+
+/*
+ * Print a trace file as text. With a word, only print its calls, each
+ * followed by its run time
+ */
+
+static int trace_decode(const char *fname, const char *word)
+{
+	FILE *f = fopen(fname, "rb");
+	struct session *s;
+	zf_ctx *ctx;
+	zf_trace_event ev, exec;
+	uint32_t hdr[3], i, t0 = 0;
+	zf_addr xt = 0;
+	int active = (word == NULL), have_exec = 0;
+	unsigned int base = 0;
+
+	if(f == NULL || fread(hdr, sizeof(hdr), 1, f) != 1 ||
+			hdr[0] != TRACE_MAGIC || hdr[1] != ZF_DICT_SIZE) {
+		fprintf(stderr, "can not read trace '%s'\n", fname);
+		return 1;
+	}
+
+	s = session_new(-1, STDOUT_FILENO, dict_map(-1, MAP_PRIVATE | MAP_ANONYMOUS));
+	ctx = &s->ctx;
+	zf_init(ctx, 0);
+	if(fread(zf_dump(ctx, NULL), ZF_DICT_SIZE, 1, f) != 1) {
+		fprintf(stderr, "can not read trace '%s'\n", fname);
+		return 1;
+	}
+
+	if(word && !zf_find(ctx, word, &xt)) {
+		fprintf(stderr, "no word '%s' in trace\n", word);
+		return 1;
+	}
+
+	for(i=0; i<hdr[2] && fread(&ev, sizeof(ev), 1, f) == 1; i++) {
+		if(word) {
+			if(active && ev.type == ZF_TRACE_EXEC && ev.rsp <= base) {
+				printf("\n--- %s %u us\n", word, ev.time - t0);
+				active = 0;
+			}
+			if(!active && (ev.type == ZF_TRACE_CALL || ev.type == ZF_TRACE_ENTER) && ev.op == xt) {
+				active = 1;
+				base = ev.rsp;
+				t0 = ev.time;
+				if(ev.type == ZF_TRACE_CALL && have_exec) trace_print(ctx, &exec);
+			}
+			if(ev.type == ZF_TRACE_EXEC) {
+				exec = ev;
+				have_exec = 1;
+			}
+			if(!active) continue;
+		}
+		trace_print(ctx, &ev);
+	}
+	printf("\n");
+
+	fclose(f);
+	session_free(s);
+	return 0;
+}
+
+
+#if ZF_ENABLE_PRIM_STATS
+
+/*
+ * Primitive statistics of the main session, written to a CSV file at exit.
+ * The first row and column hold the names, the second column how often each
+ * primitive ran. The other cells count how often the primitive of the column
+ * ran right after the one of the row.
+ */
+
+static void stats_dump(void)
+{
+	unsigned int n = zf_prim_count(), i, j;
+	FILE *f = fopen(fname_stats, "w");
+
+	if(f == NULL) {
+		perror(fname_stats);
+		return;
+	}
+	fprintf(f, "prim,count");
+	for(j=0; j<n; j++) {
+		fprintf(f, ",\"%s\"", zf_prim_name(j));
+	}
+	fprintf(f, "\n");
+	for(i=0; i<n; i++) {
+		fprintf(f, "\"%s\",%" PRIu64, zf_prim_name(i), stats[i]);
+		for(j=0; j<n; j++) {
+			fprintf(f, ",%" PRIu64, stats[n + i * n + j]);
+		}
+		fprintf(f, "\n");
+	}
+	fclose(f);
+}
+
+#endif
+
+
+/*
+ * Memory for stacks which spilled out of the context
+ */
+
+void *zf_host_realloc(zf_ctx *ctx, void *ptr, size_t size)
+{
+	if(size == 0) {
+		free(ptr);
+		return NULL;
+	}
+	return realloc(ptr, size);
+}
+
+
+/*
+ * Parse number
+ */
+
+zf_cell zf_host_parse_num(zf_ctx *ctx, const char *buf)
+{
+	zf_cell v;
+	int n = 0;
+	int r = sscanf(buf, ZF_SCAN_FMT"%n", &v, &n);
+	if(r != 1 || buf[n] != '\0') {
+		zf_abort(ctx, ZF_ABORT_NOT_A_WORD);
+	}
+	return v;
+}
+
+
+void usage(void)
+{
+	fprintf(stderr, 
+		"usage: zfort [options] [src ...]\n"
+		"\n"
+		"Options:\n"
+		"   -h         show help\n"
+		"   -t         enable tracing\n"
+		"   -l FILE    load a dictionary or snapshot from FILE\n"
+		"   -q         quiet\n"
+#if ZF_ENABLE_ANALYZE
+		"   -c         check stack effects declared in ( -- ) comments\n"
+#endif
+		"   -p PORT    serve a session per connection on localhost:PORT\n"
+		"   -C DIR     cache the dictionary changes of included files in DIR\n"
+#if ZF_ENABLE_IMAGE_TOOLS
+		"   -k FILE    remove shadowed words and save the dictionary to FILE\n"
+		"   -r WORDS   with -k, keep only the comma separated root words and what\n"
+		"              they use, without the names of the others\n"
+#endif
+		"   -s FILE    save a snapshot with the stacks to FILE instead of running\n"
+		"   -R FILE    record the session with the results of host functions\n"
+		"   -P FILE    replay a recorded session, reporting the time per line\n"
+		"   -T FILE    trace to a ring buffer of binary events, saved to FILE\n"
+		"   -d FILE    decode a binary trace to text\n"
+		"   -w WORD    with -d, only decode the calls of WORD\n"
+#if ZF_ENABLE_PRIM_STATS
+		"   -S FILE    count primitives and pairs of them, saved as CSV to FILE\n"
+#endif
+	);
+}
+
+
+/*
+ * Main
+ */
+
+int main(int argc, char **argv)
+{
+	int c;
+	int line = 0;
+	int quiet = 0;
+	int port = 0;
+	const char *fname_decode = NULL;
+	const char *trace_word = NULL;
+	const char *opts = "hl:tqp:C:R:P:T:d:w:s:"
+#if ZF_ENABLE_ANALYZE
+		"c"
+#endif
+#if ZF_ENABLE_PRIM_STATS
+		"S:"
+#endif
+#if ZF_ENABLE_IMAGE_TOOLS
+		"k:r:"
+#endif
+		;
+
+	/* Parse command line options */
+
+	while((c = getopt(argc, argv, opts)) != -1) {
+		switch(c) {
+			case 't':
+				trace = 1;
+				break;
+			case 'l':
+				fname_load = optarg;
+				break;
+			case 'h':
+				usage();
+				exit(0);
+			case 'q':
+				quiet = 1;
+				break;
+#if ZF_ENABLE_ANALYZE
+			case 'c':
+				check = 1;
+				break;
+#endif
+			case 'p':
+				port = atoi(optarg);
+				break;
+			case 'C':
+				cache_dir = optarg;
+				break;
+#if ZF_ENABLE_IMAGE_TOOLS
+			case 'k':
+				fname_compact = optarg;
+				break;
+			case 'r':
+				roots = optarg;
+				break;
+#endif
+			case 's':
+				fname_snapshot = optarg;
+				break;
+			case 'T':
+				fname_trace = optarg;
+				trace = ZF_TRACE_EVENTS;
+				break;
+#if ZF_ENABLE_PRIM_STATS
+			case 'S':
+				fname_stats = optarg;
+				break;
+#endif
+			case 'd':
+				fname_decode = optarg;
+				break;
+			case 'w':
+				trace_word = optarg;
+				break;
+			case 'R':
+			case 'P':
+				if(c == 'R') {
+					rec_file = replay_open(optarg, 1);
+				} else {
+					play_file = replay_open(optarg, 0);
+				}
+				if(rec_file == NULL && play_file == NULL) {
+					fprintf(stderr, "can not open log '%s'\n", optarg);
+					exit(1);
+				}
+				break;
+		}
+	}
+
+	/* Cached includes would skip the host functions of the log */
+
+	if(rec_file || play_file) {
+		cache_dir = NULL;
+	}
+	
+	srcs = argv + optind;
+	nsrcs = argc - optind;
+
+	if(fname_decode) {
+		return trace_decode(fname_decode, trace_word);
+	}
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if(epfd == -1) {
+		perror("epoll_create1");
+		exit(1);
+	}
+
+	if(port) {
+		if(rec_file || play_file) {
+			fprintf(stderr, "sessions of the server can not be logged\n");
+			exit(1);
+		}
+		return server(port);
+	}
+
+	struct session *s = session_new(STDIN_FILENO, STDOUT_FILENO,
+			dict_map(-1, MAP_PRIVATE | MAP_ANONYMOUS));
+	zf_ctx *ctx = &s->ctx;
+	printf("%p\n", (void *)ctx);
+	s->log = rec_file || play_file;
+
+	if(fname_trace) {
+		trace_ctx = ctx;
+		trace_start = now_ns();
+		atexit(trace_dump);
+	}
+
+#if ZF_ENABLE_PRIM_STATS
+	if(fname_stats) {
+		unsigned int n = zf_prim_count();
+		stats = calloc(n + n * n, sizeof(*stats));
+		if(stats == NULL) {
+			perror("calloc");
+			exit(1);
+		}
+		stats_ctx = ctx;
+		atexit(stats_dump);
+	}
+#endif
+
+	/* Initialize zforth, load or bootstrap the dictionary and include
+	 * files from the command line */
+
+	session_boot(s);
+
+#if ZF_ENABLE_IMAGE_TOOLS
+	/* Compact the dictionary into an image instead of running */
+
+	if(fname_compact) {
+		zf_result rv;
+		if(roots) {
+			const char *names[64];
+			int n = 0;
+			char *p = strtok(roots, ",");
+			while(p && n < 64) {
+				names[n++] = p;
+				p = strtok(NULL, ",");
+			}
+			rv = zf_shake(ctx, names, n);
+		} else {
+			rv = zf_compact(ctx);
+		}
+		report(s, fname_compact, 0, rv);
+		if(rv != ZF_OK) {
+			return 1;
+		}
+		save(ctx, fname_compact);
+		return 0;
+	}
+#endif
+
+	if(fname_snapshot) {
+		snapshot(ctx, fname_snapshot);
+		return 0;
+	}
+
+	if(!quiet) {
+		zf_cell here;
+		zf_uservar_get(ctx, ZF_USERVAR_HERE, &here);
+		printf("Welcome to zForth, %d bytes used\n", (int)here);
+	}
+
+	/* Replay the lines of a recorded session */
+
+	if(play_file) {
+		replay_type type;
+		size_t len;
+		char *buf;
+		while((buf = replay_get(play_file, &type, &len)) != NULL) {
+			if(type != REPLAY_EVAL) {
+				log_diverged("start of line");
+			}
+			do_eval(ctx, "replay", ++line, buf);
+			printf("\n");
+			free(buf);
+		}
+		return 0;
 	}
 
 	/* Interactive interpreter: read a line using readline library,
@@ -0,0 +1,120 @@
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "output.h"
+
+
+static void init(struct output *o, output_type type, int line)
+{
+	memset(o, 0, sizeof(*o));
+	o->type = type;
+	o->line = line;
+	o->fd = -1;
+}
+
+
+void output_fd(struct output *o, int fd, int line)
+{
+	init(o, OUTPUT_FD, line);
+	o->fd = fd;
+}
+
+
+void output_mem(struct output *o, char *mem, size_t size)
+{
+	init(o, OUTPUT_MEM, 0);
+	o->mem = mem;
+	o->mem_size = size;
+}
+
+
+void output_callback(struct output *o, output_fn fn, void *arg, int line)
+{
+	init(o, OUTPUT_CALLBACK, line);
+	o->fn = fn;
+	o->arg = arg;
+}
+
+
+/*
+ * Write buffered data to the destination. Returns -1 with errno EAGAIN if a
+ * non-blocking fd is not writable, keeping the rest of the data. Other write
+ * errors drop the data.
+ */
+
+int output_flush(struct output *o)
+{
+	size_t off = 0;
+	ssize_t n;
+
+	switch(o->type) {
+
+		case OUTPUT_FD:
+			while(off < o->len) {
+				n = write(o->fd, o->buf + off, o->len - off);
+				if(n < 0) {
+					if(errno == EINTR) continue;
+					if(errno == EAGAIN || errno == EWOULDBLOCK) {
+						memmove(o->buf, o->buf + off, o->len - off);
+						o->len -= off;
+						errno = EAGAIN;
+						return -1;
+					}
+					break;
+				}
+				off += n;
+			}
+			break;
+
+		case OUTPUT_MEM:
+			n = o->mem_size - o->mem_len;
+			if((size_t)n > o->len) n = o->len;
+			memcpy(o->mem + o->mem_len, o->buf, n);
+			o->mem_len += n;
+			break;
+
+		case OUTPUT_CALLBACK:
+			o->fn(o->arg, o->buf, o->len);
+			break;
+	}
+
+	o->len = 0;
+	return 0;
+}
+
+
+/*
+ * Add data to the buffer, flushing when it fills up. Returns -1 with errno
+ * EAGAIN if a flush could not complete; call again with the same arguments
+ * to continue where it left off.
+ */
+
+int output_write(struct output *o, const char *buf, size_t len)
+{
+	while(o->done < len) {
+		size_t n = len - o->done;
+		if(o->len == sizeof(o->buf) && output_flush(o) == -1) {
+			return -1;
+		}
+		if(n > sizeof(o->buf) - o->len) n = sizeof(o->buf) - o->len;
+		memcpy(o->buf + o->len, buf + o->done, n);
+		o->len += n;
+		o->done += n;
+	}
+
+	o->done = 0;
+
+	/* A line flush that can not complete leaves the data buffered */
+
+	if(o->line && memchr(buf, '\n', len)) {
+		(void)output_flush(o);
+	}
+
+	return 0;
+}
+
+/*
+ * End
+ */
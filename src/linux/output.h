@@ -0,0 +1,41 @@
+#ifndef output_h
+#define output_h
+
+#include <stddef.h>
+
+/* Buffered output. Data is collected in the buffer and written to the
+ * destination when the buffer is full, on explicit flush, or on newline if
+ * line buffering is enabled */
+
+#define OUTPUT_SIZE 4096
+
+typedef void (*output_fn)(void *arg, const char *buf, size_t len);
+
+typedef enum {
+	OUTPUT_FD,              /* write(2) to a file descriptor */
+	OUTPUT_MEM,             /* append to a memory buffer, truncating */
+	OUTPUT_CALLBACK         /* pass to a function */
+} output_type;
+
+struct output {
+	output_type type;
+	int line;               /* flush on newline */
+	int fd;
+	char *mem;
+	size_t mem_size;
+	size_t mem_len;
+	output_fn fn;
+	void *arg;
+	size_t done;            /* progress of an unfinished output_write() */
+	size_t len;
+	char buf[OUTPUT_SIZE];
+};
+
+void output_fd(struct output *o, int fd, int line);
+void output_mem(struct output *o, char *mem, size_t size);
+void output_callback(struct output *o, output_fn fn, void *arg, int line);
+
+int output_write(struct output *o, const char *buf, size_t len);
+int output_flush(struct output *o);
+
+#endif
@@ -0,0 +1,176 @@
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "queue.h"
+
+
+/*
+ * Create a queue of at least 'size' cells; 'multi' allows more than one
+ * producer. Returns NULL when out of memory.
+ */
+
+struct queue *queue_new(size_t size, int multi)
+{
+	struct queue *q = calloc(1, sizeof(*q));
+	size_t n = 2;
+
+	while(n < size) n <<= 1;
+
+	if(q == NULL) {
+		return NULL;
+	}
+	q->slot = calloc(n, sizeof(*q->slot));
+	q->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(q->slot == NULL || q->efd == -1) {
+		queue_free(q);
+		return NULL;
+	}
+	q->size = n;
+	q->multi = multi;
+	return q;
+}
+
+
+/*
+ * Free a queue which no thread uses
+ */
+
+void queue_free(struct queue *q)
+{
+	if(q->efd != -1) close(q->efd);
+	free(q->slot);
+	free(q);
+}
+
+
+/*
+ * Send a message: the head cell, followed by 'len' bytes of data. Returns 0
+ * when the queue is full, or -1 when the message is larger than the queue.
+ */
+
+int queue_put(struct queue *q, zf_cell head, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	size_t n = 1 + QUEUE_CELLS(len);
+	size_t mask = q->size - 1;
+	size_t pos, i;
+
+	if(n > q->size) {
+		return -1;
+	}
+
+	/* Claim n slots. The head only moves forward, so a stale head can only
+	 * make the queue look fuller than it is */
+
+	pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+	do {
+		if(pos + n - atomic_load_explicit(&q->head, memory_order_acquire) > q->size) {
+			return 0;
+		}
+	} while(q->multi && !atomic_compare_exchange_weak(&q->tail, &pos, pos + n));
+
+	if(!q->multi) {
+		atomic_store_explicit(&q->tail, pos + n, memory_order_relaxed);
+	}
+
+	for(i=1; i<n; i++) {
+		size_t k = len < sizeof(zf_cell) ? len : sizeof(zf_cell);
+		memcpy(&q->slot[(pos + i) & mask].v, p, k);
+		p += k;
+		len -= k;
+	}
+
+	q->slot[pos & mask].v = head;
+	atomic_store_explicit(&q->slot[pos & mask].seq, pos + 1, memory_order_release);
+
+	/* Wake the consumer only when it is sleeping; pairs with the fence in
+	 * queue_sleep() */
+
+	atomic_thread_fence(memory_order_seq_cst);
+	if(atomic_exchange(&q->sleeping, 0)) {
+		uint64_t one = 1;
+		(void)write(q->efd, &one, sizeof(one));
+	}
+
+	return 1;
+}
+
+
+/*
+ * Get the head cell of the next message without taking it. Returns 0 when
+ * the queue is empty.
+ */
+
+int queue_peek(struct queue *q, zf_cell *head)
+{
+	size_t pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+	struct queue_slot *s = &q->slot[pos & (q->size - 1)];
+
+	if(atomic_load_explicit(&s->seq, memory_order_acquire) != pos + 1) {
+		return 0;
+	}
+	*head = s->v;
+	return 1;
+}
+
+
+/*
+ * Take the message seen by queue_peek(), which carries 'size' bytes of data.
+ * At most 'len' of them are copied to 'data'.
+ */
+
+void queue_take(struct queue *q, void *data, size_t len, size_t size)
+{
+	uint8_t *p = data;
+	size_t pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+	size_t n = QUEUE_CELLS(size);
+	size_t i;
+
+	if(len > size) len = size;
+
+	for(i=1; i<=n && len > 0; i++) {
+		size_t k = len < sizeof(zf_cell) ? len : sizeof(zf_cell);
+		memcpy(p, &q->slot[(pos + i) & (q->size - 1)].v, k);
+		p += k;
+		len -= k;
+	}
+
+	atomic_store_explicit(&q->head, pos + 1 + n, memory_order_release);
+}
+
+
+/*
+ * Number of cells in the queue, including messages still being written
+ */
+
+size_t queue_count(struct queue *q)
+{
+	return atomic_load(&q->tail) - atomic_load(&q->head);
+}
+
+
+/*
+ * Prepare the consumer to wait for the eventfd. Returns 0 when a message
+ * arrived meanwhile, and there is no need to wait.
+ */
+
+int queue_sleep(struct queue *q)
+{
+	uint64_t n;
+	zf_cell v;
+
+	(void)read(q->efd, &n, sizeof(n));
+	atomic_store(&q->sleeping, 1);
+	atomic_thread_fence(memory_order_seq_cst);
+
+	if(queue_peek(q, &v)) {
+		atomic_store(&q->sleeping, 0);
+		return 0;
+	}
+	return 1;
+}
+
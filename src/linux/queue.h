@@ -0,0 +1,47 @@
+#ifndef queue_h
+#define queue_h
+
+#include <stddef.h>
+#include <stdatomic.h>
+
+#include "zforth.h"
+
+/* Lock-free message queue of cells between threads, with a single consumer
+ * and either a single or multiple producers. A message is a head cell,
+ * optionally followed by a block of bytes packed into cells. Each slot holds
+ * a sequence number which its producer sets when the slot is filled, so
+ * producers and the consumer never write the same index. A message claims
+ * all of its slots at once and publishes its head slot last: a consumer
+ * seeing the head sees the whole message. The eventfd is only written when
+ * the consumer went to sleep on it, so a busy queue passes messages without
+ * system calls */
+
+struct queue_slot {
+	atomic_size_t seq;      /* position + 1 once filled */
+	zf_cell v;
+};
+
+struct queue {
+	atomic_size_t head;     /* next position to read, consumer side */
+	char pad1[64];
+	atomic_size_t tail;     /* next position to claim, producer side */
+	char pad2[64];
+	atomic_int sleeping;    /* consumer waits for the eventfd */
+	int multi;              /* claim slots with compare-and-swap */
+	int efd;                /* eventfd, readable after a wakeup */
+	size_t size;            /* number of slots, a power of two */
+	struct queue_slot *slot;
+};
+
+struct queue *queue_new(size_t size, int multi);
+void queue_free(struct queue *q);
+
+int queue_put(struct queue *q, zf_cell head, const void *data, size_t len);
+int queue_peek(struct queue *q, zf_cell *head);
+void queue_take(struct queue *q, void *data, size_t len, size_t size);
+size_t queue_count(struct queue *q);
+int queue_sleep(struct queue *q);
+
+#define QUEUE_CELLS(len) (((len) + sizeof(zf_cell) - 1) / sizeof(zf_cell))
+
+#endif
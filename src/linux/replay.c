@@ -0,0 +1,87 @@
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "replay.h"
+
+
+#define REPLAY_MAGIC 0x3152465a /* "ZFR1" */
+#define REPLAY_MAX (1 << 20)
+
+
+/*
+ * Open a log for writing or reading, returns NULL when the file can not be
+ * opened or is not a log
+ */
+
+FILE *replay_open(const char *fname, int writing)
+{
+	uint32_t magic = REPLAY_MAGIC;
+	FILE *f = fopen(fname, writing ? "wb" : "rb");
+
+	if(f == NULL) {
+		return NULL;
+	}
+
+	if(writing) {
+		if(fwrite(&magic, sizeof(magic), 1, f) != 1) {
+			fclose(f);
+			return NULL;
+		}
+	} else {
+		if(fread(&magic, sizeof(magic), 1, f) != 1 || magic != REPLAY_MAGIC) {
+			fclose(f);
+			return NULL;
+		}
+	}
+
+	return f;
+}
+
+
+int replay_put(FILE *f, replay_type type, const void *buf, size_t len)
+{
+	uint8_t t = type;
+	uint32_t l = len;
+
+	if(fwrite(&t, 1, 1, f) != 1 || fwrite(&l, sizeof(l), 1, f) != 1) {
+		return -1;
+	}
+	if(len > 0 && fwrite(buf, len, 1, f) != 1) {
+		return -1;
+	}
+	return 0;
+}
+
+
+/*
+ * Read the next record. The payload is allocated with one more byte, which
+ * is zero, so text can be used as a string. Returns NULL at the end of the
+ * log or when it is damaged.
+ */
+
+void *replay_get(FILE *f, replay_type *type, size_t *len)
+{
+	uint8_t t;
+	uint32_t l;
+	char *buf;
+
+	if(fread(&t, 1, 1, f) != 1 || fread(&l, sizeof(l), 1, f) != 1 || l > REPLAY_MAX) {
+		return NULL;
+	}
+
+	buf = malloc(l + 1);
+	if(buf == NULL) {
+		return NULL;
+	}
+	if(l > 0 && fread(buf, l, 1, f) != 1) {
+		free(buf);
+		return NULL;
+	}
+	buf[l] = '\0';
+
+	*type = t;
+	*len = l;
+	return buf;
+}
+
@@ -0,0 +1,22 @@
+#ifndef replay_h
+#define replay_h
+
+#include <stdio.h>
+#include <stddef.h>
+
+/* Log of a session, to replay it later with the same results from the host:
+ * the lines evaluated at the top level with their run time, and the host
+ * functions they called with their results. A record is a type byte, a 32
+ * bit length and the payload */
+
+typedef enum {
+	REPLAY_EVAL = 'E',      /* line of input */
+	REPLAY_TIME = 'T',      /* run time and result of the last line */
+	REPLAY_SYS = 'S'        /* host function id, result cells and bytes */
+} replay_type;
+
+FILE *replay_open(const char *fname, int writing);
+int replay_put(FILE *f, replay_type type, const void *buf, size_t len);
+void *replay_get(FILE *f, replay_type *type, size_t *len);
+
+#endif
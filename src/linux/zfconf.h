@@ -10,6 +10,30 @@
 #define ZF_ENABLE_TRACE 1
 
 
+/* Set to 1 to let tracing produce binary events instead of text when the
+ * 'trace' user variable is 2. Each event is passed to zf_host_trace_event(),
+ * which can store it in a ring buffer; the host decodes the events to text
+ * offline, saving the formatting and output of every traced step. Requires
+ * ZF_ENABLE_TRACE */
+
+#define ZF_ENABLE_TRACE_EVENTS 1
+
+
+/* Set to 1 to let the host profile execution. While the '_profile' user
+ * variable is set, the inner interpreter passes every instruction to
+ * zf_host_profile() before running it. Costs a test per instruction when not
+ * profiling */
+
+#define ZF_ENABLE_PROFILE 1
+
+
+/* Set to 1 to let the host count how often each primitive runs, and how
+ * often each one runs right after another, see zf_prim_stats(). Costs a test
+ * per instruction when not counting */
+
+#define ZF_ENABLE_PRIM_STATS 1
+
+
 /* Set to 1 to add boundary checks to stack operations. Increases .text size
  * by approx 100 bytes */
 
@@ -32,6 +56,98 @@
 #define ZF_ENABLE_TYPED_MEM_ACCESS 1
 
 
+/* Set to 1 to pass words that are neither in the dictionary nor an integer
+ * understood by the built-in parser to zf_host_parse_num(), eg. to support
+ * floating point numbers. If 0, these abort with ZF_ABORT_NOT_A_WORD */
+
+#define ZF_ENABLE_HOST_PARSE_NUM 1
+
+
+/* Set to 1 to enable static stack effect analysis of compiled words through
+ * zf_analyze(). Requires the zf_host_sys_effect() function to be implemented
+ * to describe the stack effects of the host system calls. Adds about one kB
+ * to .text and .rodata */
+
+#define ZF_ENABLE_ANALYZE 1
+
+
+/* Set to 1 to keep the word headers apart from the code: the headers grow
+ * down from the end of the dictionary, so the code of consecutive words is
+ * contiguous. An image without the headers still runs, but words can then no
+ * longer be found by name. The image tools need inline headers */
+
+#define ZF_ENABLE_SPLIT_HEADERS 0
+
+
+/* Set to 1 to enable the dictionary rewriting tools, zf_compact() and
+ * zf_shake(). These are meant for preparing images on the host */
+
+#define ZF_ENABLE_IMAGE_TOOLS 1
+
+
+/* Set to 1 to add primitives for common words which core.zf otherwise
+ * defines in forth: over nip tuck 2dup 2drop < > <= >= 0= 1+ 1- negate abs
+ * min max +!. Each saves a call and several instructions per use, at the
+ * cost of code size */
+
+#define ZF_ENABLE_EXT_PRIMS 1
+
+
+/* Set to 1 to enable locals: '{: a b | c -- d :}' in a definition declares
+ * locals, which are kept in a frame on the return stack and read by their
+ * name or written with 'to name'. ZF_LOCAL_NAMES is the size of the buffer
+ * holding the names of the locals while a word is compiled */
+
+#define ZF_ENABLE_LOCALS 1
+#define ZF_LOCAL_NAMES 64
+
+
+/* Set to 1 to enable 'catch' and 'throw'. 'catch' runs an execution token
+ * and pushes 0, or the code given to 'throw'. Aborts inside a 'catch' push
+ * the negated abort reason instead of ending the evaluation */
+
+#define ZF_ENABLE_CATCH 1
+
+
+/* Set to 1 to enable cooperative multitasking. 'spawn' starts a word in a new
+ * task with its own data and return stack, 'yield' switches to the next task
+ * in round robin order. ZF_TASK_COUNT is the maximum number of tasks per
+ * context, including the main task. Each task adds the size of both stacks
+ * to the context */
+
+#define ZF_ENABLE_TASKS 1
+#define ZF_TASK_COUNT 8
+
+
+/* Set to 1 to let stacks grow past ZF_DSTACK_SIZE and ZF_RSTACK_SIZE: a push
+ * on a full stack moves it to heap memory from zf_host_realloc(), which
+ * doubles up to ZF_DSTACK_MAX and ZF_RSTACK_MAX cells. The stacks move back
+ * to the context when the evaluation is done. Call zf_free() before
+ * discarding a context */
+
+#define ZF_ENABLE_STACK_SPILL 1
+#define ZF_DSTACK_MAX 4096
+#define ZF_RSTACK_MAX 4096
+
+
+/* Set to 1 to let the host provide the dictionary memory: the context then
+ * holds a pointer instead of the ZF_DICT_SIZE byte array, and the host sets
+ * ctx->dict before zf_init(). This allows sharing dictionary pages between
+ * contexts, see zf_clone_mapped() */
+
+#define ZF_ENABLE_EXTERNAL_DICT 1
+
+
+/* Set to 1 to enable native words: host functions bound to a word with
+ * zf_register_native(). Each native word gets its own opcode, so calling it
+ * takes no literal id and no switch as with 'sys'. ZF_NATIVE_COUNT is the
+ * maximum number of native words per context, and adds a function pointer
+ * and stack effect to the context for each */
+
+#define ZF_ENABLE_NATIVES 1
+#define ZF_NATIVE_COUNT 32
+
+
 /* Type to use for the basic cell, data stack and return stack. Choose a signed
  * integer type that suits your needs, or 'float' or 'double' if you need
  * floating point numbers */
@@ -1,5 +1,6 @@
 
 #include <ctype.h>
+#include <limits.h>
 #include <string.h>
 #include <setjmp.h>
 
@@ -13,6 +14,11 @@
 #define ZF_FLAG_LEN(v)    (v & 0x1f)
 
 
+/* Instruction budget value for evaluation without time slicing */
+
+#define ZF_SLICE_UNLIMITED ((unsigned int)-1)
+
+
 /* This macro is used to perform boundary checks. If ZF_ENABLE_BOUNDARY_CHECKS
  * is set to 0, the boundary check code will not be compiled in to reduce size */
 
@@ -49,7 +55,23 @@ typedef enum {
 	PRIM_JMP,     PRIM_JMP0,      PRIM_TICK, PRIM_COMMENT, PRIM_PUSHR,    PRIM_POPR,
 	PRIM_EQUAL,   PRIM_SYS,       PRIM_PICK, PRIM_COMMA,   PRIM_KEY,      PRIM_LITS,
 	PRIM_LEN,     PRIM_AND,       PRIM_OR,   PRIM_XOR,     PRIM_SHL,      PRIM_SHR,
-	PRIM_LITERAL,
+	PRIM_LITERAL, PRIM_WEAK,      PRIM_PIC_START, PRIM_PIC_DIGIT, PRIM_PIC_DIGITS, PRIM_HOLD,
+	PRIM_PIC_END, PRIM_DO,        PRIM_LOOP, PRIM_PLOOP,   PRIM_I,        PRIM_J,
+	PRIM_LEAVE,   PRIM_UNLOOP,    PRIM_FRAME, PRIM_UNFRAME, PRIM_LOCAL_GET, PRIM_LOCAL_SET,
+#if ZF_ENABLE_EXT_PRIMS
+	PRIM_OVER,    PRIM_NIP,       PRIM_TUCK, PRIM_2DUP,    PRIM_2DROP,    PRIM_LT,
+	PRIM_GT,      PRIM_LE,        PRIM_GE,   PRIM_ZEQ,     PRIM_INC,      PRIM_DEC,
+	PRIM_NEGATE,  PRIM_ABS,       PRIM_MIN,  PRIM_MAX,     PRIM_ADDSTORE,
+#endif
+#if ZF_ENABLE_LOCALS
+	PRIM_LOCALS,  PRIM_TO,
+#endif
+#if ZF_ENABLE_CATCH
+	PRIM_CATCH,   PRIM_THROW,
+#endif
+#if ZF_ENABLE_TASKS
+	PRIM_SPAWN,   PRIM_YIELD,
+#endif
 	PRIM_COUNT
 } zf_prim;
 
@@ -60,7 +82,37 @@ static const char prim_names[] =
 	_("jmp")     _("jmp0")       _("'")     _("_(")    _(">r")        _("r>")
 	_("=")       _("sys")        _("pick")  _(",,")    _("key")       _("lits")
 	_("##")      _("&")          _("|")     _("^")     _("<<")        _(">>")
-	_("_literal");
+	_("_literal") _("weak")       _("<#")    _("#d")    _("#s")        _("hold")
+	_("#>")      _("(do)")       _("(loop)") _("(+loop)") _("i")       _("j")
+	_("leave")   _("unloop")     _("(frame)") _("(unframe)") _("(local@)") _("(local!)")
+#if ZF_ENABLE_EXT_PRIMS
+	_("over")    _("nip")        _("tuck")  _("2dup")  _("2drop")     _("<")
+	_(">")       _("<=")         _(">=")    _("0=")    _("1+")        _("1-")
+	_("negate")  _("abs")        _("min")   _("max")   _("+!")
+#endif
+#if ZF_ENABLE_LOCALS
+	_("_{:")     _("_to")
+#endif
+#if ZF_ENABLE_CATCH
+	_("catch")   _("throw")
+#endif
+#if ZF_ENABLE_TASKS
+	_("spawn")   _("yield")
+#endif
+	;
+
+
+/* Native words use the opcodes directly above the primitives. These are
+ * never call targets, since the start of the dictionary holds the headers of
+ * the primitives */
+
+#if ZF_ENABLE_NATIVES
+#define NATIVE_COUNT(ctx) ctx->native_count
+#define NATIVE_COUNT_MAX ZF_NATIVE_COUNT
+#else
+#define NATIVE_COUNT(ctx) 0
+#define NATIVE_COUNT_MAX 0
+#endif
 
 
 /* User variables are variables which are shared between forth and C. From
@@ -75,23 +127,101 @@ static const char prim_names[] =
 #define POSTPONE(ctx)  ctx->uservar[ZF_USERVAR_POSTPONE]  /* flag to indicate next imm word should be compiled */
 #define DSP(ctx)       ctx->uservar[ZF_USERVAR_DSP]       /* data stack pointer */
 #define RSP(ctx)       ctx->uservar[ZF_USERVAR_RSP]       /* return stack pointer */
+#define BASE(ctx)      ctx->uservar[ZF_USERVAR_BASE]      /* number base for pictured output */
+#define HP(ctx)        ctx->uservar[ZF_USERVAR_HP]        /* lowest header, 0 with inline headers */
+#define PROFILE(ctx)   ctx->uservar[ZF_USERVAR_PROFILE]   /* profiling enable flag */
 
 static const char uservar_names[] =
 	_("h")   _("latest") _("trace")  _("compiling")  _("_postpone")  _("dsp")
-	_("rsp");
+	_("rsp") _("base")   _("hp")     _("_profile");
+
+
+/* Size of the scratch area above HERE used for pictured number output, fits
+ * a cell in binary and a sign */
+
+#define ZF_HOLD_SIZE (sizeof(zf_cell) * 8 + 2)
+
+
+/* With split headers, the headers grow down from the end of the dictionary
+ * while the code grows up from HERE. The top leaves room for reading the
+ * last cell of a header */
+
+#if ZF_ENABLE_SPLIT_HEADERS
+#define HEADS_TOP (ZF_DICT_SIZE - sizeof(zf_cell))
+#define HEADS_SIZE(ctx) (HEADS_TOP - HP(ctx))
+#else
+#define HEADS_SIZE(ctx) 0
+#endif
+
+
+/* Size in cells of the stacks of the current task, which only changes when
+ * the stacks spill to the heap */
+
+#if ZF_ENABLE_STACK_SPILL
+#define DSTACK_SIZE(ctx) ctx->task[ctx->task_cur].dsize
+#define RSTACK_SIZE(ctx) ctx->task[ctx->task_cur].rsize
+#else
+#define DSTACK_SIZE(ctx) ZF_DSTACK_SIZE
+#define RSTACK_SIZE(ctx) ZF_RSTACK_SIZE
+#endif
 
 
 
 /* Prototypes */
 
 static void do_prim(zf_ctx *ctx, zf_prim prim, const char *input);
+static void do_native(zf_ctx *ctx, zf_addr n, const char *input);
 static zf_addr dict_get_cell(zf_ctx *ctx, zf_addr addr, zf_cell *v);
 static void dict_get_bytes(zf_ctx *ctx, zf_addr addr, void *buf, size_t len);
+static zf_addr header(zf_ctx *ctx, zf_addr w, int *lenflags, zf_addr *link, zf_addr *name);
+
+
+/*
+ * Name lookup of words and primitives
+ */
+
+static const char *find_name(zf_ctx *ctx, zf_addr addr, int opcode)
+{
+	zf_addr w = LATEST(ctx);
+	char *name = ctx->name_buf;
+
+	while(w) {
+		zf_addr xt, p, link;
+		zf_cell op2;
+		int lenflags;
+
+		xt = header(ctx, w, &lenflags, &link, &p);
+		dict_get_cell(ctx, xt, &op2);
+
+		if((opcode && (lenflags & ZF_FLAG_PRIM) && addr == (zf_addr)op2) || addr == w || addr == xt) {
+			int l = ZF_FLAG_LEN(lenflags);
+			dict_get_bytes(ctx, p, name, l);
+			name[l] = '\0';
+			return name;
+		}
+
+		w = link;
+	}
+	return "?";
+}
+
+
+/*
+ * Name of the word with the given header address or execution token, or
+ * with 'opcode' set also the given primitive opcode; "?" if there is none.
+ * Used to decode binary traces and to name profiled words.
+ */
+
+const char *zf_op_name(zf_ctx *ctx, zf_addr addr, int opcode)
+{
+	return find_name(ctx, addr, opcode);
+}
 
 
 /* Tracing functions. If disabled, the trace() function is replaced by an empty
  * macro, allowing the compiler to optimize away the function calls to
- * op_name() */
+ * op_name(). trace_event() traces a step either as binary event or as text,
+ * and only evaluates the text arguments when tracing text */
 
 #if ZF_ENABLE_TRACE
 
@@ -105,42 +235,60 @@ static void do_trace(zf_ctx *ctx, const char *fmt, ...)
 	}
 }
 
-#define trace(ctx, ...) if(TRACE(ctx)) do_trace(ctx, __VA_ARGS__)
+#if ZF_ENABLE_TRACE_EVENTS
 
-static const char *op_name(zf_ctx *ctx, zf_addr addr)
+static void do_trace_event(zf_ctx *ctx, zf_trace_type type, zf_addr addr, zf_addr op, zf_cell v)
 {
-	zf_addr w = LATEST(ctx);
-	char *name = ctx->name_buf;
-
-	while(TRACE(ctx) && w) {
-		zf_addr xt, p = w;
-		zf_cell d, link, op2;
-		int lenflags;
+	zf_trace_event ev;
+
+	ev.addr = addr;
+	ev.op = op;
+	ev.v = v;
+	ev.time = 0;
+	ev.rsp = RSP(ctx);
+	ev.dsp = DSP(ctx);
+	ev.type = type;
+	zf_host_trace_event(ctx, &ev);
+}
 
-		p += dict_get_cell(ctx, p, &d);
-		lenflags = d;
-		p += dict_get_cell(ctx, p, &link);
-		xt = p + ZF_FLAG_LEN(lenflags);
-		dict_get_cell(ctx, xt, &op2);
+#define trace(ctx, ...) if(TRACE(ctx) && TRACE(ctx) != ZF_TRACE_EVENTS) do_trace(ctx, __VA_ARGS__)
+#define trace_event(ctx, type, addr, op, v, ...) \
+	if(TRACE(ctx)) { \
+		if(TRACE(ctx) == ZF_TRACE_EVENTS) do_trace_event(ctx, type, addr, op, v); \
+		else do_trace(ctx, __VA_ARGS__); \
+	}
 
-		if(((lenflags & ZF_FLAG_PRIM) && addr == (zf_addr)op2) || addr == w || addr == xt) {
-			int l = ZF_FLAG_LEN(lenflags);
-			dict_get_bytes(ctx, p, name, l);
-			name[l] = '\0';
-			return name;
-		}
+#else
+#define trace(ctx, ...) if(TRACE(ctx)) do_trace(ctx, __VA_ARGS__)
+#define trace_event(ctx, type, addr, op, v, ...) trace(ctx, __VA_ARGS__)
+#endif
 
-		w = link;
-	}
-	return "?";
+static const char *op_name(zf_ctx *ctx, zf_addr addr)
+{
+	return find_name(ctx, addr, 1);
 }
 
+
 #else
 static void trace(zf_ctx *ctx, const char *fmt, ...) { }
+#define trace_event(ctx, type, addr, op, v, ...) trace(ctx, __VA_ARGS__)
 static const char *op_name(zf_ctx *ctx, zf_addr addr) { return NULL; }
 #endif
 
 
+/*
+ * Profiling. The host gets each instruction before it runs, with the return
+ * stack depth and whether it calls a word, and ZF_PROFILE_STOP when the inner
+ * interpreter stops
+ */
+
+#if ZF_ENABLE_PROFILE
+#define profile(ctx, op, call) if(PROFILE(ctx)) zf_host_profile(ctx, op, RSP(ctx), call)
+#else
+#define profile(ctx, op, call)
+#endif
+
+
 /*
  * Handle abort by unwinding the C stack and sending control back into
  * zf_eval()
@@ -153,14 +301,136 @@ void zf_abort(zf_ctx *ctx, zf_result reason)
 
 
 
+#if ZF_ENABLE_STACK_SPILL
+
+/*
+ * Stack spilling. A stack which is full moves from the task slot to a heap
+ * area, which doubles in size up to the maximum. 'fixed' is the stack in the
+ * slot, 'used' the number of cells in use. Returns the stack to use, which is
+ * unchanged if no memory is available
+ */
+
+static zf_cell *spill(zf_ctx *ctx, zf_cell *fixed, zf_cell **heap, zf_addr *size,
+		zf_addr used, zf_addr need, zf_addr max)
+{
+	zf_addr n = *size;
+	zf_cell *p;
+
+	while(n < need) {
+		n *= 2;
+	}
+	if(n > max) {
+		n = max;
+	}
+
+	if(n >= need) {
+		p = (zf_cell *)zf_host_realloc(ctx, *heap, n * sizeof(zf_cell));
+		if(p) {
+			if(*heap == NULL) {
+				memcpy(p, fixed, (used < *size ? used : *size) * sizeof(zf_cell));
+			}
+			*heap = p;
+			*size = n;
+			trace_event(ctx, ZF_TRACE_SPILL, 0, 0, n, "spill %d ", n);
+		}
+	}
+
+	return *heap ? *heap : fixed;
+}
+
+
+/*
+ * Move a heap stack back to the task slot if the cells in use fit
+ */
+
+static zf_cell *unspill(zf_ctx *ctx, zf_cell *fixed, zf_cell **heap, zf_addr *size,
+		zf_addr used, zf_addr fixed_size)
+{
+	if(*heap && used <= fixed_size) {
+		memcpy(fixed, *heap, used * sizeof(zf_cell));
+		zf_host_realloc(ctx, *heap, 0);
+		*heap = NULL;
+		*size = fixed_size;
+	}
+
+	return *heap ? *heap : fixed;
+}
+
+
+/*
+ * Make room for 'dn' and 'rn' cells on the stacks of the current task.
+ * Returns 0 if that does not fit
+ */
+
+static int stack_reserve(zf_ctx *ctx, zf_addr dn, zf_addr rn)
+{
+	zf_task *t = &ctx->task[ctx->task_cur];
+
+	if(dn > t->dsize) {
+		ctx->dstack = spill(ctx, t->dstack, &t->dspill, &t->dsize, DSP(ctx), dn, ZF_DSTACK_MAX);
+	}
+	if(rn > t->rsize) {
+		ctx->rstack = spill(ctx, t->rstack, &t->rspill, &t->rsize, RSP(ctx), rn, ZF_RSTACK_MAX);
+	}
+
+	return dn <= t->dsize && rn <= t->rsize;
+}
+
+
+static void stack_shrink(zf_ctx *ctx)
+{
+	zf_task *t = &ctx->task[ctx->task_cur];
+
+	ctx->dstack = unspill(ctx, t->dstack, &t->dspill, &t->dsize, DSP(ctx), ZF_DSTACK_SIZE);
+	ctx->rstack = unspill(ctx, t->rstack, &t->rspill, &t->rsize, RSP(ctx), ZF_RSTACK_SIZE);
+}
+
+
+/*
+ * Free the heap stacks of all tasks, which empties them. Call before
+ * discarding a context or restoring another one into it
+ */
+
+void zf_free(zf_ctx *ctx)
+{
+	unsigned int i;
+
+	for(i=0; i<ZF_TASK_COUNT; i++) {
+		zf_task *t = &ctx->task[i];
+		zf_cell *d = unspill(ctx, t->dstack, &t->dspill, &t->dsize, 0, ZF_DSTACK_SIZE);
+		zf_cell *r = unspill(ctx, t->rstack, &t->rspill, &t->rsize, 0, ZF_RSTACK_SIZE);
+		if(i == ctx->task_cur) {
+			ctx->dstack = d;
+			ctx->rstack = r;
+			DSP(ctx) = 0;
+			RSP(ctx) = 0;
+		}
+	}
+}
+
+#else
+
+void zf_free(zf_ctx *ctx)
+{
+	(void)ctx;
+}
+
+#endif
+
+
 /*
  * Stack operations. 
  */
 
 void zf_push(zf_ctx *ctx, zf_cell v)
 {
-	CHECK(ctx, DSP(ctx) < ZF_DSTACK_SIZE, ZF_ABORT_DSTACK_OVERRUN);
-	trace(ctx, "»" ZF_CELL_FMT " ", v);
+#if ZF_ENABLE_STACK_SPILL
+	if(DSP(ctx) >= DSTACK_SIZE(ctx)) {
+		stack_reserve(ctx, DSP(ctx) + 1, 0);
+	}
+#endif
+	CHECK(ctx, DSP(ctx) < DSTACK_SIZE(ctx), ZF_ABORT_DSTACK_OVERRUN);
+	trace_event(ctx, ZF_TRACE_PUSH, 0, 0, v, "»" ZF_CELL_FMT " ", v);
 	ctx->dstack[DSP(ctx)++] = v;
 }
 
@@ -169,9 +439,9 @@ zf_cell zf_pop(zf_ctx *ctx)
 {
 	zf_cell v;
 	CHECK(ctx, DSP(ctx) > 0, ZF_ABORT_DSTACK_UNDERRUN);
-	CHECK(ctx, DSP(ctx) <= ZF_DSTACK_SIZE, ZF_ABORT_DSTACK_OVERRUN);
+	CHECK(ctx, DSP(ctx) <= DSTACK_SIZE(ctx), ZF_ABORT_DSTACK_OVERRUN);
 	v = ctx->dstack[--DSP(ctx)];
-	trace(ctx, "«" ZF_CELL_FMT " ", v);
+	trace_event(ctx, ZF_TRACE_POP, 0, 0, v, "«" ZF_CELL_FMT " ", v);
 	return v;
 }
 
@@ -179,15 +449,20 @@ zf_cell zf_pop(zf_ctx *ctx)
 zf_cell zf_pick(zf_ctx *ctx, zf_addr n)
 {
 	CHECK(ctx, n < DSP(ctx), ZF_ABORT_DSTACK_UNDERRUN);
-	CHECK(ctx, DSP(ctx) <= ZF_DSTACK_SIZE, ZF_ABORT_DSTACK_OVERRUN);
+	CHECK(ctx, DSP(ctx) <= DSTACK_SIZE(ctx), ZF_ABORT_DSTACK_OVERRUN);
 	return ctx->dstack[DSP(ctx)-n-1];
 }
 
 
 static void zf_pushr(zf_ctx *ctx, zf_cell v)
 {
-	CHECK(ctx, RSP(ctx) < ZF_RSTACK_SIZE, ZF_ABORT_RSTACK_OVERRUN);
-	trace(ctx, "r»" ZF_CELL_FMT " ", v);
+#if ZF_ENABLE_STACK_SPILL
+	if(RSP(ctx) >= RSTACK_SIZE(ctx)) {
+		stack_reserve(ctx, 0, RSP(ctx) + 1);
+	}
+#endif
+	CHECK(ctx, RSP(ctx) < RSTACK_SIZE(ctx), ZF_ABORT_RSTACK_OVERRUN);
+	trace_event(ctx, ZF_TRACE_RPUSH, 0, 0, v, "r»" ZF_CELL_FMT " ", v);
 	ctx->rstack[RSP(ctx)++] = v;
 }
 
@@ -196,16 +471,16 @@ static zf_cell zf_popr(zf_ctx *ctx)
 {
 	zf_cell v;
 	CHECK(ctx, RSP(ctx) > 0, ZF_ABORT_RSTACK_UNDERRUN);
-	CHECK(ctx, RSP(ctx) <= ZF_RSTACK_SIZE, ZF_ABORT_RSTACK_OVERRUN);
+	CHECK(ctx, RSP(ctx) <= RSTACK_SIZE(ctx), ZF_ABORT_RSTACK_OVERRUN);
 	v = ctx->rstack[--RSP(ctx)];
-	trace(ctx, "r«" ZF_CELL_FMT " ", v);
+	trace_event(ctx, ZF_TRACE_RPOP, 0, 0, v, "r«" ZF_CELL_FMT " ", v);
 	return v;
 }
 
 zf_cell zf_pickr(zf_ctx *ctx, zf_addr n)
 {
 	CHECK(ctx, n < RSP(ctx), ZF_ABORT_RSTACK_UNDERRUN);
-	CHECK(ctx, RSP(ctx) <= ZF_RSTACK_SIZE, ZF_ABORT_RSTACK_OVERRUN);
+	CHECK(ctx, RSP(ctx) <= RSTACK_SIZE(ctx), ZF_ABORT_RSTACK_OVERRUN);
 	return ctx->rstack[RSP(ctx)-n-1];
 }
 
@@ -256,7 +531,7 @@ static zf_addr dict_put_cell_typed(zf_ctx *ctx, zf_addr addr, zf_cell v, zf_mem_
 	unsigned int vi = v;
 	uint8_t t[2];
 
-	trace(ctx, "\n+" ZF_ADDR_FMT " " ZF_ADDR_FMT, addr, (zf_addr)v);
+	trace_event(ctx, ZF_TRACE_WRITE, addr, size, v, "\n+" ZF_ADDR_FMT " " ZF_ADDR_FMT, addr, (zf_addr)v);
 
 	if(size == ZF_MEM_SIZE_VAR) {
 		if((v - vi) == 0) {
@@ -354,8 +629,11 @@ static zf_addr dict_get_cell(zf_ctx *ctx, zf_addr addr, zf_cell *v)
 
 static void dict_add_cell_typed(zf_ctx *ctx, zf_cell v, zf_mem_size size)
 {
+#if ZF_ENABLE_SPLIT_HEADERS
+	CHECK(ctx, HERE(ctx) + 1 + sizeof(zf_cell) <= HP(ctx), ZF_ABORT_OUTSIDE_MEM);
+#endif
 	HERE(ctx) += dict_put_cell_typed(ctx, HERE(ctx), v, size);
-	trace(ctx, " ");
+	trace_event(ctx, ZF_TRACE_ADD, 0, 0, 0, " ");
 }
 
 
@@ -368,7 +646,7 @@ static void dict_add_cell(zf_ctx *ctx, zf_cell v)
 static void dict_add_op(zf_ctx *ctx, zf_addr op)
 {
 	dict_add_cell(ctx, op);
-	trace(ctx, "+%s ", op_name(ctx, op));
+	trace_event(ctx, ZF_TRACE_OP, 0, op, 0, "+%s ", op_name(ctx, op));
 }
 
 
@@ -379,14 +657,57 @@ static void dict_add_lit(zf_ctx *ctx, zf_cell v)
 }
 
 
+#if !ZF_ENABLE_SPLIT_HEADERS
 static void dict_add_str(zf_ctx *ctx, const char *s)
 {
 	size_t l;
-	trace(ctx, "\n+" ZF_ADDR_FMT " " ZF_ADDR_FMT " s '%s'", HERE(ctx), 0, s);
+	trace_event(ctx, ZF_TRACE_STR, HERE(ctx), 0, 0, "\n+" ZF_ADDR_FMT " " ZF_ADDR_FMT " s '%s'", HERE(ctx), 0, s);
 	l = strlen(s);
 	HERE(ctx) += dict_put_bytes(ctx, HERE(ctx), s, l);
 }
+#endif
+
+
+#if ZF_ENABLE_SPLIT_HEADERS
+
+/*
+ * Size of the variable size encoding of a cell
+ */
+
+static zf_addr cell_size(zf_cell v)
+{
+	unsigned int vi = v;
+
+	if((v - vi) == 0) {
+		if(vi < 128) return 1;
+		if(vi < 16384) return 2;
+	}
+	return 1 + sizeof(zf_cell);
+}
+
+
+/*
+ * Create new word with its header below the lowest header, pointing to the
+ * code at HERE(ctx)
+ */
+
+static void create(zf_ctx *ctx, const char *name, int flags)
+{
+	size_t len = strlen(name);
+	zf_addr w, p, size;
+	size = 1 + cell_size(LATEST(ctx)) + len + cell_size(HERE(ctx));
+	w = p = HP(ctx) - size;
+	trace_event(ctx, ZF_TRACE_CREATE, w, 0, 0, "\n=== create '%s'", name);
+	CHECK(ctx, HP(ctx) - HERE(ctx) > size + ZF_HOLD_SIZE, ZF_ABORT_OUTSIDE_MEM);
+	p += dict_put_cell(ctx, p, len | flags);
+	p += dict_put_cell(ctx, p, LATEST(ctx));
+	p += dict_put_bytes(ctx, p, name, len);
+	dict_put_cell(ctx, p, HERE(ctx));
+	HP(ctx) = LATEST(ctx) = w;
+	trace_event(ctx, ZF_TRACE_END, 0, 0, 0, "\n===");
+}
 
+#else
 
 /*
  * Create new word, adjusting HERE(ctx) and LATEST(ctx) accordingly
@@ -395,13 +716,40 @@ static void dict_add_str(zf_ctx *ctx, const char *s)
 static void create(zf_ctx *ctx, const char *name, int flags)
 {
 	zf_addr here_prev;
-	trace(ctx, "\n=== create '%s'", name);
 	here_prev = HERE(ctx);
+	trace_event(ctx, ZF_TRACE_CREATE, here_prev, 0, 0, "\n=== create '%s'", name);
 	dict_add_cell(ctx, (strlen(name)) | flags);
 	dict_add_cell(ctx, LATEST(ctx));
 	dict_add_str(ctx, name);
 	LATEST(ctx) = here_prev;
-	trace(ctx, "\n===");
+	trace_event(ctx, ZF_TRACE_END, 0, 0, 0, "\n===");
+}
+
+#endif
+
+
+/*
+ * Parse the header of word 'w'. Returns the execution token and sets the
+ * length and flags, the link and the address of the name. With split
+ * headers the execution token follows the name, otherwise the code does
+ */
+
+static zf_addr header(zf_ctx *ctx, zf_addr w, int *lenflags, zf_addr *link, zf_addr *name)
+{
+	zf_cell d, l;
+	zf_addr p = w;
+
+	p += dict_get_cell(ctx, p, &d);
+	p += dict_get_cell(ctx, p, &l);
+	if(lenflags) *lenflags = d;
+	if(link) *link = l;
+	if(name) *name = p;
+	p += ZF_FLAG_LEN((int)d);
+#if ZF_ENABLE_SPLIT_HEADERS
+	dict_get_cell(ctx, p, &d);
+	p = d;
+#endif
+	return p;
 }
 
 
@@ -415,17 +763,16 @@ static int find_word(zf_ctx *ctx, const char *name, zf_addr *word, zf_addr *code
 	size_t namelen = strlen(name);
 
 	while(w) {
-		zf_cell link, d;
-		zf_addr p = w;
+		zf_addr link, p, xt;
 		size_t len;
-		p += dict_get_cell(ctx, p, &d);
-		p += dict_get_cell(ctx, p, &link);
-		len = ZF_FLAG_LEN((int)d);
+		int lenflags;
+		xt = header(ctx, w, &lenflags, &link, &p);
+		len = ZF_FLAG_LEN(lenflags);
 		if(len == namelen) {
 			const char *name2 = (const char *)&ctx->dict[p];
 			if(memcmp(name, name2, len) == 0) {
 				*word = w;
-				*code = p + len;
+				*code = xt;
 				return 1;
 			}
 		}
@@ -436,102 +783,437 @@ static int find_word(zf_ctx *ctx, const char *name, zf_addr *word, zf_addr *code
 }
 
 
-/*
- * Set 'immediate' flag in last compiled word
- */
-
-static void make_immediate(zf_ctx *ctx)
-{
-	zf_cell lenflags;
-	dict_get_cell(ctx, LATEST(ctx), &lenflags);
-	dict_put_cell(ctx, LATEST(ctx), (int)lenflags | ZF_FLAG_IMMEDIATE);
-}
-
+#if ZF_ENABLE_LOCALS
 
 /*
- * Inner interpreter
+ * Locals of the word being compiled. Their index in the frame is the order
+ * of declaration
  */
 
-static void run(zf_ctx *ctx, const char *input)
+static void add_local(zf_ctx *ctx, const char *name)
 {
-	while(ctx->ip != 0) {
-		zf_cell d;
-		zf_addr i, ip_org = ctx->ip;
-		zf_addr l = dict_get_cell(ctx, ctx->ip, &d);
-		zf_addr code = d;
-
-		trace(ctx, "\n "ZF_ADDR_FMT " " ZF_ADDR_FMT " ", ctx->ip, code);
-		for(i=0; i<RSP(ctx); i++) trace(ctx, "┊  ");
-		
-		ctx->ip += l;
+	size_t len = strlen(name) + 1;
 
-		if(code < PRIM_COUNT) {
-			do_prim(ctx, (zf_prim)code, input);
+	CHECK(ctx, ctx->local_len + len <= sizeof(ctx->local_names), ZF_ABORT_INVALID_SIZE);
+	if(ctx->local_count == 0) {
+		ctx->local_len = 0;
+		ctx->local_init = 0;
+	}
+	memcpy(ctx->local_names + ctx->local_len, name, len);
+	ctx->local_len += len;
+	ctx->local_count ++;
+	if(ctx->local_mode == 0) {
+		ctx->local_init ++;
+	}
+}
 
-			/* If the prim requests input, restore IP so that the
-			 * next time around we call the same prim again */
 
-			if(ctx->input_state != ZF_INPUT_INTERPRET) {
-				ctx->ip = ip_org;
-				break;
-			}
+static int find_local(zf_ctx *ctx, const char *name, zf_addr *n)
+{
+	const char *p = ctx->local_names;
+	zf_addr i;
 
-		} else {
-			trace(ctx, "%s/" ZF_ADDR_FMT " ", op_name(ctx, code), code);
-			zf_pushr(ctx, ctx->ip);
-			ctx->ip = code;
+	for(i=0; i<ctx->local_count; i++) {
+		if(strcmp(p, name) == 0) {
+			*n = i;
+			return 1;
 		}
+		p += strlen(p) + 1;
+	}
 
-		input = NULL;
-	} 
+	return 0;
 }
 
+#endif
+
 
 /*
- * Execute bytecode from given address
+ * Drop the latest word if an older word with the same name exists. This
+ * allows fallback definitions for words the host may provide natively
  */
 
-static void execute(zf_ctx *ctx, zf_addr addr)
+static void weak(zf_ctx *ctx)
 {
-	ctx->ip = addr;
-	RSP(ctx) = 0;
-	zf_pushr(ctx, 0);
+	zf_addr w = LATEST(ctx), p, link, xt, w2, code;
+	int len;
 
-	trace(ctx, "\n[%s/" ZF_ADDR_FMT "] ", op_name(ctx, ctx->ip), ctx->ip);
-	run(ctx, NULL);
+	xt = header(ctx, w, &len, &link, &p);
+	len = ZF_FLAG_LEN(len);
+	dict_get_bytes(ctx, p, ctx->name_buf, len);
+	ctx->name_buf[len] = '\0';
 
+	LATEST(ctx) = link;
+	if(find_word(ctx, ctx->name_buf, &w2, &code)) {
+#if ZF_ENABLE_SPLIT_HEADERS
+		zf_cell d;
+		HERE(ctx) = xt;
+		HP(ctx) = p + len + dict_get_cell(ctx, p + len, &d);
+#else
+		(void)xt;
+		HERE(ctx) = w;
+#endif
+	} else {
+		LATEST(ctx) = w;
+	}
 }
 
 
-/* 
- * Peek at memory, either user variables or dictionary memory,
- * returns number of bytes read
+/*
+ * Set 'immediate' flag in last compiled word
  */
-static zf_addr peek(zf_ctx *ctx, zf_addr addr, zf_cell *val, zf_mem_size size)
-{
-	if(addr < ZF_USERVAR_COUNT) {
-		/* Special case for user variables */
-		*val = ctx->uservar[addr];
-		return 1;
-	} else {
-		/* General case for dictionary memory */
-		return dict_get_cell_typed(ctx, addr, val, size);
-	}
 
+static void make_immediate(zf_ctx *ctx)
+{
+	zf_cell lenflags;
+	dict_get_cell(ctx, LATEST(ctx), &lenflags);
+	dict_put_cell(ctx, LATEST(ctx), (int)lenflags | ZF_FLAG_IMMEDIATE);
 }
 
 
+#if ZF_ENABLE_TASKS
+
 /*
- * Run primitive opcode
+ * Cooperative multitasking. The stack pointers in the user variables always
+ * belong to the current task, the state of the other tasks is saved in their
+ * slot.
  */
 
-static void do_prim(zf_ctx *ctx, zf_prim op, const char *input)
+static void task_switch(zf_ctx *ctx, unsigned int n)
 {
-	zf_cell d1, d2, d3;
+	zf_task *t = &ctx->task[ctx->task_cur];
+
+	t->ip = ctx->ip;
+	t->dsp = DSP(ctx);
+	t->rsp = RSP(ctx);
+	t->fp = ctx->fp;
+#if ZF_ENABLE_CATCH
+	t->handler = ctx->handler;
+#endif
+
+	t = &ctx->task[n];
+	ctx->task_cur = n;
+	ctx->ip = t->ip;
+#if ZF_ENABLE_STACK_SPILL
+	ctx->dstack = t->dspill ? t->dspill : t->dstack;
+	ctx->rstack = t->rspill ? t->rspill : t->rstack;
+#else
+	ctx->dstack = t->dstack;
+	ctx->rstack = t->rstack;
+#endif
+	DSP(ctx) = t->dsp;
+	RSP(ctx) = t->rsp;
+	ctx->fp = t->fp;
+#if ZF_ENABLE_CATCH
+	ctx->handler = t->handler;
+#endif
+	trace_event(ctx, ZF_TRACE_TASK, 0, 0, n, "task %d ", n);
+}
+
+
+/*
+ * Switch to the next task in round robin order which is not finished; the
+ * current task is the last candidate. Returns 0 if all tasks are finished.
+ */
+
+static int task_next(zf_ctx *ctx)
+{
+	unsigned int i, n;
+
+	ctx->task[ctx->task_cur].ip = ctx->ip;
+
+	for(i=1; i<=ZF_TASK_COUNT; i++) {
+		n = (ctx->task_cur + i) % ZF_TASK_COUNT;
+		if(ctx->task[n].ip != 0) {
+			task_switch(ctx, n);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+
+/*
+ * Start a new task executing the given word. It runs when the current task
+ * yields or finishes.
+ */
+
+static void task_spawn(zf_ctx *ctx, zf_addr xt)
+{
+	unsigned int n;
+
+	for(n=1; n<ZF_TASK_COUNT; n++) {
+		zf_task *t = &ctx->task[n];
+		if(t->ip == 0) {
+#if ZF_ENABLE_STACK_SPILL
+			unspill(ctx, t->dstack, &t->dspill, &t->dsize, 0, ZF_DSTACK_SIZE);
+			unspill(ctx, t->rstack, &t->rspill, &t->rsize, 0, ZF_RSTACK_SIZE);
+#endif
+			t->ip = xt;
+			t->dsp = 0;
+			t->rstack[0] = 0;
+			t->rsp = 1;
+			t->fp = 0;
+#if ZF_ENABLE_CATCH
+			t->handler = 0;
+#endif
+			return;
+		}
+	}
+
+	zf_abort(ctx, ZF_ABORT_NO_FREE_TASK);
+}
+
+#endif
+
+
+#if ZF_ENABLE_CATCH
+
+/*
+ * Exception handling. 'catch' saves the data stack depth, frame pointer,
+ * outer handler and its own return address on the return stack, and calls
+ * the execution token with CATCH_RETURN as return address. Returning there
+ * ends the catch with code 0; 'throw' and aborts end it with their code,
+ * dropping what the execution token left on the stacks.
+ */
+
+#define CATCH_RETURN 1
+
+static void catch(zf_ctx *ctx, zf_addr xt)
+{
+	zf_pushr(ctx, DSP(ctx));
+	zf_pushr(ctx, ctx->fp);
+	zf_pushr(ctx, ctx->handler);
+	zf_pushr(ctx, ctx->ip);
+	ctx->handler = RSP(ctx);
+	zf_pushr(ctx, CATCH_RETURN);
+	ctx->ip = xt;
+}
+
+
+static void catch_end(zf_ctx *ctx, zf_cell code)
+{
+	zf_addr dsp;
+
+	RSP(ctx) = ctx->handler;
+	ctx->handler = 0;
+	ctx->ip = zf_popr(ctx);
+	ctx->handler = zf_popr(ctx);
+	ctx->fp = zf_popr(ctx);
+	dsp = zf_popr(ctx);
+	if(code != 0) {
+		DSP(ctx) = dsp;
+	}
+	ctx->input_state = ZF_INPUT_INTERPRET;
+	trace_event(ctx, ZF_TRACE_CATCH, 0, 0, code, "catch " ZF_CELL_FMT " ", code);
+	zf_push(ctx, code);
+}
+
+#endif
+
+
+/*
+ * Primitive statistics: a count per primitive, followed by the counts of
+ * each primitive running right after another one. Calls of words and native
+ * words break the chain
+ */
+
+#if ZF_ENABLE_PRIM_STATS
+static void prim_stats(zf_ctx *ctx, zf_addr code)
+{
+	if(code < PRIM_COUNT) {
+		ctx->prim_stats[code] ++;
+		if(ctx->prim_last < PRIM_COUNT) {
+			ctx->prim_stats[PRIM_COUNT + ctx->prim_last * PRIM_COUNT + code] ++;
+		}
+		ctx->prim_last = code;
+	} else {
+		ctx->prim_last = PRIM_COUNT;
+	}
+}
+#endif
+
+
+/*
+ * Inner interpreter
+ */
+
+static void run(zf_ctx *ctx, const char *input)
+{
+#if ZF_ENABLE_PRIM_STATS
+	/* A prim receiving input runs again, which is not counted */
+	if(input == NULL) ctx->prim_last = PRIM_COUNT;
+#endif
+
+	for(;;) {
+		zf_cell d;
+		zf_addr i, ip_org, l, code;
+
+		if(ctx->ip == 0) {
+#if ZF_ENABLE_TASKS
+			/* The current task is finished, keep running the
+			 * others until all are done */
+			if(task_next(ctx)) continue;
+			task_switch(ctx, 0);
+#endif
+			profile(ctx, ZF_PROFILE_STOP, 0);
+			break;
+		}
+
+		/* Suspend when the instruction budget is spent. A prim
+		 * receiving input always runs to consume it */
+
+		if(input == NULL && ctx->slice != ZF_SLICE_UNLIMITED) {
+			if(ctx->slice == 0) {
+				profile(ctx, ZF_PROFILE_STOP, 0);
+				break;
+			}
+			ctx->slice --;
+		}
+
+		ip_org = ctx->ip;
+		l = dict_get_cell(ctx, ctx->ip, &d);
+		code = d;
+
+		profile(ctx, code, code >= PRIM_COUNT + NATIVE_COUNT(ctx));
+#if ZF_ENABLE_PRIM_STATS
+		if(ctx->prim_stats && input == NULL) prim_stats(ctx, code);
+#endif
+
+		trace_event(ctx, ZF_TRACE_EXEC, ctx->ip, code, DSP(ctx) ? ctx->dstack[DSP(ctx)-1] : 0,
+				"\n "ZF_ADDR_FMT " " ZF_ADDR_FMT " ", ctx->ip, code);
+		for(i=0; i<RSP(ctx); i++) trace(ctx, "┊  ");
+		
+		ctx->ip += l;
+
+		if(code < PRIM_COUNT + NATIVE_COUNT(ctx)) {
+			if(code < PRIM_COUNT) {
+				do_prim(ctx, (zf_prim)code, input);
+			} else {
+				do_native(ctx, code - PRIM_COUNT, input);
+			}
+
+			/* If the prim requests input, restore IP so that the
+			 * next time around we call the same prim again */
+
+			if(ctx->input_state != ZF_INPUT_INTERPRET) {
+				ctx->ip = ip_org;
+				profile(ctx, ZF_PROFILE_STOP, 0);
+				break;
+			}
+
+		} else {
+			trace_event(ctx, ZF_TRACE_CALL, 0, code, 0, "%s/" ZF_ADDR_FMT " ", op_name(ctx, code), code);
+			zf_pushr(ctx, ctx->ip);
+			ctx->ip = code;
+		}
+
+		input = NULL;
+	} 
+}
+
+
+/*
+ * Pictured number output: characters are added in front of the string built
+ * downwards from hld_end. Numbers are taken as unsigned integers as wide as
+ * a cell, so a negative number gives the digits of its two's complement.
+ * Floating point cells outside that range abort.
+ */
+
+static void hold(zf_ctx *ctx, zf_cell c)
+{
+	uint8_t b = (int)c;
+	CHECK(ctx, ctx->hld > HERE(ctx), ZF_ABORT_OUTSIDE_MEM);
+	ctx->hld --;
+	dict_put_bytes(ctx, ctx->hld, &b, 1);
+}
+
+static zf_cell hold_digits(zf_ctx *ctx, zf_cell v, int all)
+{
+	unsigned int base = BASE(ctx), d;
+	uintmax_t half = (uintmax_t)1 << (sizeof(zf_cell) * 8 - 1);
+	uintmax_t u;
+
+	CHECK(ctx, base >= 2 && base <= 36, ZF_ABORT_INVALID_SIZE);
+	CHECK(ctx, v >= -(double)half && v < 2.0 * half, ZF_ABORT_INVALID_SIZE);
+	if(v < 0) {
+		u = (uintmax_t)(intmax_t)v & (half - 1 + half);
+	} else {
+		u = (uintmax_t)v;
+	}
+	do {
+		d = u % base;
+		hold(ctx, d < 10 ? '0' + d : 'a' + d - 10);
+		u /= base;
+	} while(u != 0 && all);
+
+	return u;
+}
+
+
+/*
+ * Call native word, it handles input and pending state like a system call
+ */
+
+static void do_native(zf_ctx *ctx, zf_addr n, const char *input)
+{
+#if ZF_ENABLE_NATIVES
+	trace_event(ctx, ZF_TRACE_PRIM, 0, PRIM_COUNT + n, 0, "(%s) ", op_name(ctx, PRIM_COUNT + n));
+	if(ctx->native[n].fn == NULL) {
+		zf_abort(ctx, ZF_ABORT_NOT_A_WORD);
+	}
+	ctx->input_state = ctx->native[n].fn(ctx, input);
+#endif
+}
+
+
+/*
+ * Execute bytecode from given address. The return address 0 stops the inner
+ * interpreter when the word is done; it is pushed on top of the return
+ * stack, so execution can be nested in a system call.
+ */
+
+static void execute(zf_ctx *ctx, zf_addr addr)
+{
+	ctx->ip = addr;
+	profile(ctx, addr, 1);
+	zf_pushr(ctx, 0);
+
+	trace_event(ctx, ZF_TRACE_ENTER, 0, addr, 0, "\n[%s/" ZF_ADDR_FMT "] ", op_name(ctx, ctx->ip), ctx->ip);
+	run(ctx, NULL);
+
+}
+
+
+/* 
+ * Peek at memory, either user variables or dictionary memory,
+ * returns number of bytes read
+ */
+static zf_addr peek(zf_ctx *ctx, zf_addr addr, zf_cell *val, zf_mem_size size)
+{
+	if(addr < ZF_USERVAR_COUNT) {
+		/* Special case for user variables */
+		*val = ctx->uservar[addr];
+		return 1;
+	} else {
+		/* General case for dictionary memory */
+		return dict_get_cell_typed(ctx, addr, val, size);
+	}
+
+}
+
+
+/*
+ * Run primitive opcode
+ */
+
+static void do_prim(zf_ctx *ctx, zf_prim op, const char *input)
+{
+	zf_cell d1, d2, d3;
 	zf_addr addr, code;
 	zf_mem_size size;
 
-	trace(ctx, "(%s) ", op_name(ctx, op));
+	trace_event(ctx, ZF_TRACE_PRIM, 0, op, 0, "(%s) ", op_name(ctx, op));
 
 	switch(op) {
 
@@ -542,6 +1224,9 @@ static void do_prim(zf_ctx *ctx, zf_prim op, const char *input)
 			} else {
 				create(ctx, input, 0);
 				COMPILING(ctx) = 1;
+#if ZF_ENABLE_LOCALS
+				ctx->local_count = 0;
+#endif
 			}
 			break;
 
@@ -552,8 +1237,14 @@ static void do_prim(zf_ctx *ctx, zf_prim op, const char *input)
 
 		case PRIM_SEMICOL:
 			/* End of word definition */
+#if ZF_ENABLE_LOCALS
+			if(ctx->local_count) {
+				dict_add_op(ctx, PRIM_UNFRAME);
+				ctx->local_count = 0;
+			}
+#endif
 			dict_add_op(ctx, PRIM_EXIT);
-			trace(ctx, "\n===");
+			trace_event(ctx, ZF_TRACE_END, 0, 0, 0, "\n===");
 			COMPILING(ctx) = 0;
 			break;
 
@@ -565,6 +1256,41 @@ static void do_prim(zf_ctx *ctx, zf_prim op, const char *input)
 			/* FIXME: else abort "!compiling"? */
 			break;
 
+		case PRIM_WEAK:
+			/* Drop the latest word if it redefines an existing one */
+			weak(ctx);
+			break;
+
+		case PRIM_PIC_START:
+			/* Start pictured number output in the area above HERE */
+			ctx->hld = ctx->hld_end = HERE(ctx) + ZF_HOLD_SIZE;
+#if ZF_ENABLE_SPLIT_HEADERS
+			CHECK(ctx, ctx->hld_end < HP(ctx), ZF_ABORT_OUTSIDE_MEM);
+#endif
+			break;
+
+		case PRIM_PIC_DIGIT:
+			/* Add least significant digit of unsigned number */
+			zf_push(ctx, hold_digits(ctx, zf_pop(ctx), 0));
+			break;
+
+		case PRIM_PIC_DIGITS:
+			/* Add all remaining digits, at least one */
+			zf_push(ctx, hold_digits(ctx, zf_pop(ctx), 1));
+			break;
+
+		case PRIM_HOLD:
+			/* Add character */
+			hold(ctx, zf_pop(ctx));
+			break;
+
+		case PRIM_PIC_END:
+			/* Drop number, push address and length of the string */
+			zf_pop(ctx);
+			zf_push(ctx, ctx->hld);
+			zf_push(ctx, ctx->hld_end - ctx->hld);
+			break;
+
 		case PRIM_LIT:
 			/* At run time, push next value from dictionary on stack */
 			ctx->ip += dict_get_cell(ctx, ctx->ip, &d1);
@@ -574,6 +1300,11 @@ static void do_prim(zf_ctx *ctx, zf_prim op, const char *input)
 		case PRIM_EXIT:
 			/* Return from word */
 			ctx->ip = zf_popr(ctx);
+#if ZF_ENABLE_CATCH
+			if(ctx->ip == CATCH_RETURN) {
+				catch_end(ctx, 0);
+			}
+#endif
 			break;
 		
 		case PRIM_LEN:
@@ -690,7 +1421,7 @@ static void do_prim(zf_ctx *ctx, zf_prim op, const char *input)
 		case PRIM_JMP:
 			/* Jump to address */
 			ctx->ip += dict_get_cell(ctx, ctx->ip, &d1);
-			trace(ctx, "ip " ZF_ADDR_FMT "=>" ZF_ADDR_FMT, ctx->ip, (zf_addr)d1);
+			trace_event(ctx, ZF_TRACE_JUMP, ctx->ip, d1, 0, "ip " ZF_ADDR_FMT "=>" ZF_ADDR_FMT, ctx->ip, (zf_addr)d1);
 			ctx->ip = d1;
 			break;
 
@@ -698,7 +1429,7 @@ static void do_prim(zf_ctx *ctx, zf_prim op, const char *input)
 			/* Jump to address if top of stack is zero */
 			ctx->ip += dict_get_cell(ctx, ctx->ip, &d1);
 			if(zf_pop(ctx) == 0) {
-				trace(ctx, "ip " ZF_ADDR_FMT "=>" ZF_ADDR_FMT, ctx->ip, (zf_addr)d1);
+				trace_event(ctx, ZF_TRACE_JUMP, ctx->ip, d1, 0, "ip " ZF_ADDR_FMT "=>" ZF_ADDR_FMT, ctx->ip, (zf_addr)d1);
 				ctx->ip = d1;
 			}
 			break;
@@ -707,7 +1438,7 @@ static void do_prim(zf_ctx *ctx, zf_prim op, const char *input)
 			/* Compile next word */
 			if (COMPILING(ctx)) {
 				ctx->ip += dict_get_cell(ctx, ctx->ip, &d1);
-				trace(ctx, "%s/", op_name(ctx, d1));
+				trace_event(ctx, ZF_TRACE_TICK, 0, d1, 0, "%s/", op_name(ctx, d1));
 				zf_push(ctx, d1);
 			}
 			else {
@@ -793,69 +1524,437 @@ static void do_prim(zf_ctx *ctx, zf_prim op, const char *input)
 			zf_push(ctx, (zf_int)zf_pop(ctx) >> (zf_int)d1);
 			break;
 
-		default:
-			zf_abort(ctx, ZF_ABORT_INTERNAL_ERROR);
+		case PRIM_DO:
+			/* Start counted loop; consumes limit and index, and keeps
+			 * the leave address, limit and index on the return stack */
+			ctx->ip += dict_get_cell(ctx, ctx->ip, &d1);
+			d2 = zf_pop(ctx); d3 = zf_pop(ctx);
+			zf_pushr(ctx, d1);
+			zf_pushr(ctx, d3);
+			zf_pushr(ctx, d2);
 			break;
-	}
-}
 
+		case PRIM_LOOP:
+		case PRIM_PLOOP:
+			/* Add one or top of stack to the loop index, jump back
+			 * unless the index passed the limit, else end the loop */
+			ctx->ip += dict_get_cell(ctx, ctx->ip, &d1);
+			d2 = op == PRIM_PLOOP ? zf_pop(ctx) : 1;
+			CHECK(ctx, RSP(ctx) >= 3, ZF_ABORT_RSTACK_UNDERRUN);
+			CHECK(ctx, RSP(ctx) <= RSTACK_SIZE(ctx), ZF_ABORT_RSTACK_OVERRUN);
+			d3 = ctx->rstack[RSP(ctx)-1] += d2;
+			if(d2 < 0 ? d3 >= ctx->rstack[RSP(ctx)-2] : d3 < ctx->rstack[RSP(ctx)-2]) {
+				trace_event(ctx, ZF_TRACE_JUMP, ctx->ip, d1, 0, "ip " ZF_ADDR_FMT "=>" ZF_ADDR_FMT, ctx->ip, (zf_addr)d1);
+				ctx->ip = d1;
+			} else {
+				RSP(ctx) -= 3;
+			}
+			break;
 
-/*
- * Handle incoming word. Compile or interpreted the word, or pass it to a
- * deferred primitive if it requested a word from the input stream.
- */
+		case PRIM_I:
+			/* Push index of innermost loop */
+			zf_push(ctx, zf_pickr(ctx, 0));
+			break;
 
-static void handle_word(zf_ctx *ctx, const char *buf)
-{
-	zf_addr w, c = 0;
-	int found;
+		case PRIM_J:
+			/* Push index of next outer loop */
+			zf_push(ctx, zf_pickr(ctx, 3));
+			break;
 
-	/* If a word was requested by an earlier operation, resume with the new
-	 * word */
+		case PRIM_LEAVE:
+			/* End loop, jump past it */
+			ctx->ip = zf_pickr(ctx, 2);
+			RSP(ctx) -= 3;
+			break;
 
-	if(ctx->input_state == ZF_INPUT_PASS_WORD) {
-		ctx->input_state = ZF_INPUT_INTERPRET;
-		run(ctx, buf);
-		return;
-	}
+		case PRIM_UNLOOP:
+			/* Drop loop parameters, before exit from a loop */
+			zf_pickr(ctx, 2);
+			RSP(ctx) -= 3;
+			break;
 
-	/* Look up the word in the dictionary */
+		case PRIM_FRAME:
+			/* Start frame of locals on the return stack, after the
+			 * saved frame pointer. Operands are the number of locals
+			 * and how many of them are taken from the stack, the
+			 * others start at zero */
+			ctx->ip += dict_get_cell(ctx, ctx->ip, &d1);
+			ctx->ip += dict_get_cell(ctx, ctx->ip, &d2);
+			zf_pushr(ctx, ctx->fp);
+			ctx->fp = RSP(ctx);
+			for(addr=d2; addr>0; addr--) {
+				zf_pushr(ctx, zf_pick(ctx, addr-1));
+			}
+			for(addr=d2; addr>0; addr--) {
+				zf_pop(ctx);
+			}
+			for(addr=d2; addr<(zf_addr)d1; addr++) {
+				zf_pushr(ctx, 0);
+			}
+			break;
 
-	found = find_word(ctx, buf, &w, &c);
+		case PRIM_UNFRAME:
+			/* Drop frame of locals, restore frame pointer */
+			CHECK(ctx, ctx->fp > 0 && ctx->fp <= RSP(ctx), ZF_ABORT_RSTACK_UNDERRUN);
+			RSP(ctx) = ctx->fp;
+			ctx->fp = zf_popr(ctx);
+			break;
 
-	if(found) {
+		case PRIM_LOCAL_GET:
+			/* Push local, the operand is its index in the frame */
+			ctx->ip += dict_get_cell(ctx, ctx->ip, &d1);
+			addr = ctx->fp + (zf_addr)d1;
+			CHECK(ctx, addr < RSP(ctx), ZF_ABORT_RSTACK_UNDERRUN);
+			CHECK(ctx, RSP(ctx) <= RSTACK_SIZE(ctx), ZF_ABORT_RSTACK_OVERRUN);
+			zf_push(ctx, ctx->rstack[addr]);
+			break;
 
-		/* Word found: compile or execute, depending on flags and state */
+		case PRIM_LOCAL_SET:
+			/* Pop into local, the operand is its index in the frame */
+			ctx->ip += dict_get_cell(ctx, ctx->ip, &d1);
+			addr = ctx->fp + (zf_addr)d1;
+			CHECK(ctx, addr < RSP(ctx), ZF_ABORT_RSTACK_UNDERRUN);
+			CHECK(ctx, RSP(ctx) <= RSTACK_SIZE(ctx), ZF_ABORT_RSTACK_OVERRUN);
+			ctx->rstack[addr] = zf_pop(ctx);
+			break;
 
-		zf_cell d;
-		int flags;
-		dict_get_cell(ctx, w, &d);
-		flags = d;
+#if ZF_ENABLE_EXT_PRIMS
+		case PRIM_OVER:
+			/* Copy next element on stack to top */
+			zf_push(ctx, zf_pick(ctx, 1));
+			break;
 
-		if(COMPILING(ctx) && (POSTPONE(ctx) || !(flags & ZF_FLAG_IMMEDIATE))) {
-			if(flags & ZF_FLAG_PRIM) {
-				dict_get_cell(ctx, c, &d);
-				dict_add_op(ctx, d);
-			} else {
-				dict_add_op(ctx, c);
-			}
-			POSTPONE(ctx) = 0;
-		} else {
-			execute(ctx, c);
-		}
-	} else {
+		case PRIM_NIP:
+			/* Drop next element on stack */
+			d1 = zf_pop(ctx); zf_pop(ctx);
+			zf_push(ctx, d1);
+			break;
 
-		/* Word not found: try to convert to a number and compile or push, depending
-		 * on state */
+		case PRIM_TUCK:
+			/* Copy top element on stack below the next element */
+			d1 = zf_pop(ctx); d2 = zf_pop(ctx);
+			zf_push(ctx, d1); zf_push(ctx, d2); zf_push(ctx, d1);
+			break;
 
-		zf_cell v = zf_host_parse_num(ctx, buf);
+		case PRIM_2DUP:
+			/* Duplicate top two elements on stack */
+			zf_push(ctx, zf_pick(ctx, 1));
+			zf_push(ctx, zf_pick(ctx, 1));
+			break;
 
-		if(COMPILING(ctx)) {
-			dict_add_lit(ctx, v);
-		} else {
-			zf_push(ctx, v);
-		}
-	}
+		case PRIM_2DROP:
+			/* Drop top two elements from stack */
+			zf_pop(ctx); zf_pop(ctx);
+			break;
+
+		case PRIM_LT:
+		case PRIM_GT:
+		case PRIM_LE:
+		case PRIM_GE:
+			/* Compare next element on stack with top element */
+			d1 = zf_pop(ctx); d2 = zf_pop(ctx);
+			zf_push(ctx, (op == PRIM_LT ? d2 < d1 : op == PRIM_GT ? d2 > d1 :
+					op == PRIM_LE ? d2 <= d1 : d2 >= d1) ? ZF_TRUE : ZF_FALSE);
+			break;
+
+		case PRIM_ZEQ:
+			/* Push true if zero, else false */
+			zf_push(ctx, zf_pop(ctx) == 0 ? ZF_TRUE : ZF_FALSE);
+			break;
+
+		case PRIM_INC:
+			zf_push(ctx, zf_pop(ctx) + 1);
+			break;
+
+		case PRIM_DEC:
+			zf_push(ctx, zf_pop(ctx) - 1);
+			break;
+
+		case PRIM_NEGATE:
+			zf_push(ctx, -zf_pop(ctx));
+			break;
+
+		case PRIM_ABS:
+			d1 = zf_pop(ctx);
+			zf_push(ctx, d1 < 0 ? -d1 : d1);
+			break;
+
+		case PRIM_MIN:
+		case PRIM_MAX:
+			/* Keep the smaller or larger of the top two elements */
+			d1 = zf_pop(ctx); d2 = zf_pop(ctx);
+			zf_push(ctx, (op == PRIM_MIN) == (d1 < d2) ? d1 : d2);
+			break;
+
+		case PRIM_ADDSTORE:
+			/* Add next element on stack to the cell at the address on top */
+			addr = zf_pop(ctx);
+			d1 = zf_pop(ctx);
+			peek(ctx, addr, &d2, ZF_MEM_SIZE_VAR);
+			if(addr < ZF_USERVAR_COUNT) {
+				ctx->uservar[addr] = d1 + d2;
+			} else {
+				dict_put_cell_typed(ctx, addr, d1 + d2, ZF_MEM_SIZE_VAR);
+			}
+			break;
+#endif
+
+#if ZF_ENABLE_LOCALS
+		case PRIM_LOCALS:
+			/* Declare locals, reading names up to ':}'. Names before
+			 * '|' take their value from the stack, names after it
+			 * start at zero, and names after '--' are a comment */
+			if(input == NULL) {
+				CHECK(ctx, COMPILING(ctx), ZF_ABORT_COMPILE_ONLY_WORD);
+				CHECK(ctx, ctx->local_count == 0, ZF_ABORT_INVALID_SIZE);
+				ctx->local_mode = 0;
+				ctx->input_state = ZF_INPUT_PASS_WORD;
+			} else if(strcmp(input, ":}") == 0) {
+				if(ctx->local_count) {
+					dict_add_op(ctx, PRIM_FRAME);
+					dict_add_cell(ctx, ctx->local_count);
+					dict_add_cell(ctx, ctx->local_init);
+				}
+			} else {
+				if(strcmp(input, "|") == 0) {
+					ctx->local_mode = 1;
+				} else if(strcmp(input, "--") == 0) {
+					ctx->local_mode = 2;
+				} else if(ctx->local_mode < 2) {
+					add_local(ctx, input);
+				}
+				ctx->input_state = ZF_INPUT_PASS_WORD;
+			}
+			break;
+
+		case PRIM_TO:
+			/* Compile store into the local named by the next word */
+			if(input == NULL) {
+				ctx->input_state = ZF_INPUT_PASS_WORD;
+			} else {
+				if(!find_local(ctx, input, &addr)) {
+					zf_abort(ctx, ZF_ABORT_NOT_A_WORD);
+				}
+				dict_add_op(ctx, PRIM_LOCAL_SET);
+				dict_add_cell(ctx, addr);
+			}
+			break;
+#endif
+
+#if ZF_ENABLE_CATCH
+		case PRIM_CATCH:
+			/* Call execution token, push 0 or the code it throws */
+			catch(ctx, zf_pop(ctx));
+			break;
+
+		case PRIM_THROW:
+			/* End the innermost catch with the given code, unless 0 */
+			d1 = zf_pop(ctx);
+			if(d1 != 0) {
+				if(ctx->handler == 0) {
+					zf_abort(ctx, ZF_ABORT_THROW);
+				}
+				catch_end(ctx, d1);
+			}
+			break;
+#endif
+
+#if ZF_ENABLE_TASKS
+		case PRIM_SPAWN:
+			/* Start new task running the given execution token */
+			task_spawn(ctx, zf_pop(ctx));
+			break;
+
+		case PRIM_YIELD:
+			/* Switch to the next task */
+			task_next(ctx);
+			break;
+#endif
+
+		default:
+			zf_abort(ctx, ZF_ABORT_INTERNAL_ERROR);
+			break;
+	}
+}
+
+
+/*
+ * Built-in number parser for integers: in the current base, hex with '$' or
+ * '0x' prefix, binary with '%' prefix, all with an optional '-', and
+ * character literals like 'a'. Returns 0 when the word is not such a
+ * number, or when the cell can not hold it exactly.
+ */
+
+static int parse_num(zf_ctx *ctx, const char *buf, zf_cell *v)
+{
+	const char *p = buf;
+	unsigned long n = 0;
+	unsigned int base = BASE(ctx), d;
+	long l;
+	int neg = 0;
+
+	if(p[0] == '\'' && p[1] != '\0' && p[2] == '\'' && p[3] == '\0') {
+		*v = (uint8_t)p[1];
+		return 1;
+	}
+
+	if(base < 2 || base > 36) {
+		base = 10;
+	}
+
+	if(*p == '-') {
+		neg = 1;
+		p ++;
+	}
+
+	if(*p == '$') {
+		base = 16;
+		p ++;
+	} else if(*p == '%') {
+		base = 2;
+		p ++;
+	} else if(p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) {
+		base = 16;
+		p += 2;
+	}
+
+	if(*p == '\0') {
+		return 0;
+	}
+
+	/* Stay below LONG_MAX / 2, so converting the cell back to long can not
+	 * overflow when it is rounded up */
+
+	for(; *p; p++) {
+		if(*p >= '0' && *p <= '9') {
+			d = *p - '0';
+		} else if((*p | 0x20) >= 'a' && (*p | 0x20) <= 'z') {
+			d = (*p | 0x20) - 'a' + 10;
+		} else {
+			return 0;
+		}
+		if(d >= base || n > ((unsigned long)LONG_MAX / 2 - d) / base) {
+			return 0;
+		}
+		n = n * base + d;
+	}
+
+	l = neg ? -(long)n : (long)n;
+	*v = (zf_cell)l;
+	return (long)*v == l;
+}
+
+
+/*
+ * True when a word starts like a number: with a digit or a prefix, after
+ * an optional '-'
+ */
+
+static int num_first(const char *buf)
+{
+	const char *p = buf[0] == '-' ? buf + 1 : buf;
+	return (*p >= '0' && *p <= '9') || *p == '$' || *p == '%' || *p == '\'';
+}
+
+
+/*
+ * Compile or push a number, depending on state
+ */
+
+static void handle_num(zf_ctx *ctx, zf_cell v)
+{
+	if(COMPILING(ctx)) {
+		dict_add_lit(ctx, v);
+	} else {
+		zf_push(ctx, v);
+	}
+}
+
+
+/*
+ * Handle incoming word. Compile or interpreted the word, or pass it to a
+ * deferred primitive if it requested a word from the input stream.
+ */
+
+static void handle_word(zf_ctx *ctx, const char *buf)
+{
+	zf_addr w, c = 0;
+	zf_cell v;
+	int found;
+
+	/* If a word was requested by an earlier operation, resume with the new
+	 * word */
+
+	if(ctx->input_state == ZF_INPUT_PASS_WORD) {
+		ctx->input_state = ZF_INPUT_INTERPRET;
+		run(ctx, buf);
+		return;
+	}
+
+#if ZF_ENABLE_LOCALS
+	/* Locals of the word being compiled hide words of the same name */
+
+	if(COMPILING(ctx) && find_local(ctx, buf, &c)) {
+		dict_add_op(ctx, PRIM_LOCAL_GET);
+		dict_add_cell(ctx, c);
+		return;
+	}
+#endif
+
+	/* Words starting like a number are parsed before looking up the word,
+	 * saving a full scan of the dictionary for each number. Others, like
+	 * 'ff' in hex, are only numbers when there is no word of that name */
+
+	if(num_first(buf) && parse_num(ctx, buf, &v)) {
+		handle_num(ctx, v);
+		return;
+	}
+
+	/* Look up the word in the dictionary */
+
+	found = find_word(ctx, buf, &w, &c);
+
+	if(found) {
+
+		/* Word found: compile or execute, depending on flags and state */
+
+		zf_cell d;
+		int flags;
+		dict_get_cell(ctx, w, &d);
+		flags = d;
+
+		if(COMPILING(ctx) && (POSTPONE(ctx) || !(flags & ZF_FLAG_IMMEDIATE))) {
+			if(flags & ZF_FLAG_PRIM) {
+				dict_get_cell(ctx, c, &d);
+#if ZF_ENABLE_LOCALS
+				/* Leaving a word drops its locals */
+				if(d == PRIM_EXIT && ctx->local_count) {
+					dict_add_op(ctx, PRIM_UNFRAME);
+				}
+#endif
+				dict_add_op(ctx, d);
+			} else {
+				dict_add_op(ctx, c);
+			}
+			POSTPONE(ctx) = 0;
+		} else {
+			execute(ctx, c);
+		}
+	} else {
+
+		/* Word not found: try the number again in the current base, then
+		 * let the host try to convert it */
+
+		if(!num_first(buf) && parse_num(ctx, buf, &v)) {
+			handle_num(ctx, v);
+			return;
+		}
+#if ZF_ENABLE_HOST_PARSE_NUM
+		handle_num(ctx, zf_host_parse_num(ctx, buf));
+#else
+		zf_abort(ctx, ZF_ABORT_NOT_A_WORD);
+#endif
+	}
 }
 
 
@@ -892,10 +1991,58 @@ static void handle_char(zf_ctx *ctx, char c)
  * Initialisation
  */
 
-void zf_init(zf_ctx *ctx, int enable_trace)
+/*
+ * Reset the interpreter state and the pointers into the context itself, the
+ * dictionary is left as it is. Heap stacks are not freed, see zf_free()
+ */
+
+static void reset(zf_ctx *ctx)
 {
+	unsigned int i;
+
+	for(i=0; i<ZF_TASK_COUNT; i++) {
+		ctx->task[i].ip = 0;
+#if ZF_ENABLE_STACK_SPILL
+		ctx->task[i].dspill = NULL;
+		ctx->task[i].rspill = NULL;
+		ctx->task[i].dsize = ZF_DSTACK_SIZE;
+		ctx->task[i].rsize = ZF_RSTACK_SIZE;
+#endif
+	}
+	ctx->task_cur = 0;
+	ctx->dstack = ctx->task[0].dstack;
+	ctx->rstack = ctx->task[0].rstack;
+
 	ctx->uservar = (zf_addr *)ctx->dict;
+	ctx->ip = 0;
+	ctx->fp = 0;
+#if ZF_ENABLE_CATCH
+	ctx->handler = 0;
+#endif
+	ctx->input_state = ZF_INPUT_INTERPRET;
+	ctx->src = NULL;
+	ctx->slice = ZF_SLICE_UNLIMITED;
 	ctx->read_len = 0;
+	ctx->hld = ctx->hld_end = 0;
+#if ZF_ENABLE_LOCALS
+	ctx->local_count = 0;
+#endif
+}
+
+
+void zf_init(zf_ctx *ctx, int enable_trace)
+{
+#if ZF_ENABLE_NATIVES
+	unsigned int i;
+#endif
+
+	reset(ctx);
+#if ZF_ENABLE_NATIVES
+	for(i=0; i<ZF_NATIVE_COUNT; i++) {
+		ctx->native[i].fn = NULL;
+	}
+	ctx->native_count = 0;
+#endif
 	HERE(ctx) = ZF_USERVAR_COUNT * sizeof(zf_addr);
 	LATEST(ctx) = 0;
 	TRACE(ctx) = enable_trace;
@@ -903,6 +2050,16 @@ void zf_init(zf_ctx *ctx, int enable_trace)
 	POSTPONE(ctx) = 0;
 	DSP(ctx) = 0;
 	RSP(ctx) = 0;
+	BASE(ctx) = 10;
+#if ZF_ENABLE_SPLIT_HEADERS
+	HP(ctx) = HEADS_TOP;
+#else
+	HP(ctx) = 0;
+#endif
+	PROFILE(ctx) = 0;
+#if ZF_ENABLE_PRIM_STATS
+	ctx->prim_stats = NULL;
+#endif
 }
 
 
@@ -959,62 +2116,1313 @@ void zf_bootstrap(void) {}
 
 
 /*
- * Eval forth string
+ * An evaluation is suspended when the inner interpreter stopped in the middle
+ * of a word without waiting for input: the instruction budget is spent, or a
+ * system call is pending
  */
 
-zf_result zf_eval(zf_ctx *ctx, const char *buf)
+static int suspended(zf_ctx *ctx)
+{
+	return ctx->ip != 0 &&
+		(ctx->input_state == ZF_INPUT_INTERPRET || ctx->input_state == ZF_INPUT_PENDING);
+}
+
+
+/*
+ * Evaluate the remaining input at ctx->src, after calling the word at 'xt'
+ * if not zero, running at most 'max' instructions if not zero. On abort the
+ * return and data stacks are reset to the given depths.
+ */
+
+static zf_result eval(zf_ctx *ctx, unsigned int max, zf_addr rsp, zf_addr dsp, zf_addr xt)
 {
-	zf_result r = (zf_result)setjmp(ctx->jmpbuf);
+	zf_result r;
+	volatile zf_addr call = xt;
+
+	ctx->slice = max ? max : ZF_SLICE_UNLIMITED;
+	r = (zf_result)setjmp(ctx->jmpbuf);
+
+#if ZF_ENABLE_CATCH
+	/* An abort inside a catch ends the catch with the negated reason,
+	 * and the evaluation goes on after it */
+	if(r != ZF_OK && ctx->handler) {
+		catch_end(ctx, -(zf_cell)r);
+		r = ZF_OK;
+	}
+#endif
 
 	if(r == ZF_OK) {
-		for(;;) {
-			handle_char(ctx, *buf);
-			if(*buf == '\0') {
-				return ZF_OK;
-			}
-			buf ++;
+		char c;
+
+		if(call) {
+			xt = call;
+			call = 0;
+			trace_event(ctx, ZF_TRACE_ENTER, 0, xt, 0, "\n[%s/" ZF_ADDR_FMT "] ", op_name(ctx, xt), xt);
+			profile(ctx, xt, 1);
+			zf_pushr(ctx, 0);
+			ctx->ip = xt;
+		}
+
+		if(suspended(ctx)) {
+			ctx->input_state = ZF_INPUT_INTERPRET;
+			run(ctx, NULL);
+		}
+
+		while(!suspended(ctx) && ctx->src) {
+			c = *ctx->src;
+			ctx->src = c ? ctx->src + 1 : NULL;
+			handle_char(ctx, c);
+		}
+
+		if(suspended(ctx)) {
+			return ZF_YIELD;
 		}
+#if ZF_ENABLE_STACK_SPILL
+		stack_shrink(ctx);
+#endif
+		return ZF_OK;
+
 	} else {
+#if ZF_ENABLE_TASKS
+		/* Kill the aborted task and return to the main task */
+		ctx->ip = 0;
+		task_switch(ctx, 0);
+#endif
+		ctx->ip = 0;
+		ctx->fp = 0;
+#if ZF_ENABLE_CATCH
+		ctx->handler = 0;
+#endif
+		ctx->src = NULL;
 		COMPILING(ctx) = 0;
-		RSP(ctx) = 0;
-		DSP(ctx) = 0;
+#if ZF_ENABLE_LOCALS
+		ctx->local_count = 0;
+#endif
+		RSP(ctx) = rsp;
+		DSP(ctx) = dsp;
+		profile(ctx, ZF_PROFILE_STOP, 0);
+#if ZF_ENABLE_STACK_SPILL
+		stack_shrink(ctx);
+#endif
 		return r;
 	}
 }
 
 
-void *zf_dump(zf_ctx *ctx, size_t *len)
-{
-	if(len) *len = sizeof(ctx->dict);
-	return ctx->dict;
-}
+/*
+ * Start evaluating 'buf' or calling 'xt'. The state of an outer evaluation
+ * is saved, so this can be called from a system call. An abort clears the
+ * data stack, but a nested evaluation keeps what the outer one had on it.
+ */
 
-zf_result zf_uservar_set(zf_ctx *ctx, zf_uservar_id uv, zf_cell v)
+static zf_result start(zf_ctx *ctx, const char *buf, zf_addr xt, unsigned int max)
 {
-	zf_result result = ZF_ABORT_INVALID_USERVAR;
+	zf_result r;
+	jmp_buf jmpbuf;
+	const char *src = ctx->src;
+	unsigned int slice = ctx->slice;
+	zf_addr ip = ctx->ip;
+	zf_addr fp = ctx->fp;
+#if ZF_ENABLE_CATCH
+	zf_addr handler = ctx->handler;
+#endif
+	int nested = suspended(ctx);
+
+	if(nested) {
+		memcpy(jmpbuf, ctx->jmpbuf, sizeof(jmpbuf));
+		ctx->ip = 0;
+#if ZF_ENABLE_CATCH
+		/* Catches of the outer evaluation are out of reach */
+		ctx->handler = 0;
+#endif
+	}
 
-	if (uv < ZF_USERVAR_COUNT) {
-		ctx->uservar[uv] = v;
-		result = ZF_OK;
+	ctx->src = buf;
+	r = eval(ctx, max, RSP(ctx), nested ? DSP(ctx) : 0, xt);
+
+	if(nested && r != ZF_YIELD) {
+		memcpy(ctx->jmpbuf, jmpbuf, sizeof(jmpbuf));
+		ctx->src = src;
+		ctx->slice = slice;
+		ctx->ip = ip;
+		ctx->fp = fp;
+#if ZF_ENABLE_CATCH
+		ctx->handler = handler;
+#endif
 	}
 
-	return result;
+	return r;
 }
 
-zf_result zf_uservar_get(zf_ctx *ctx, zf_uservar_id uv, zf_cell *v)
+
+/*
+ * Eval forth string, running at most 'max' instructions if not zero. Returns
+ * ZF_YIELD if the budget is spent or a system call returned ZF_INPUT_PENDING
+ * before the evaluation is done, which can be resumed with zf_run_slice();
+ * 'buf' should stay valid until then. This can be called from a system call.
+ */
+
+zf_result zf_eval_slice(zf_ctx *ctx, const char *buf, unsigned int max)
 {
-	zf_result result = ZF_ABORT_INVALID_USERVAR;
+	return start(ctx, buf, 0, max);
+}
 
-	if (uv < ZF_USERVAR_COUNT) {
-		if (v != NULL) {
-			*v = ctx->uservar[uv];
-		}
-		result = ZF_OK;
-	}
 
-	return result;
+/*
+ * Resume a suspended evaluation, running at most 'max' instructions if not
+ * zero. A pending system call is called again.
+ */
+
+zf_result zf_run_slice(zf_ctx *ctx, unsigned int max)
+{
+	return eval(ctx, max, 0, 0, 0);
+}
+
+
+/*
+ * Call the word at 'xt' with the arguments on the data stack, without
+ * parsing its name as zf_eval() would. Returns ZF_YIELD like zf_eval_slice()
+ * when a system call is pending.
+ */
+
+zf_result zf_call(zf_ctx *ctx, zf_addr xt)
+{
+	return start(ctx, NULL, xt, 0);
 }
 
+
+/*
+ * Eval forth string
+ */
+
+zf_result zf_eval(zf_ctx *ctx, const char *buf)
+{
+	return zf_eval_slice(ctx, buf, 0);
+}
+
+
+void *zf_dump(zf_ctx *ctx, size_t *len)
+{
+	if(len) *len = ZF_DICT_SIZE;
+	return ctx->dict;
+}
+
+
+/*
+ * Snapshots hold the used part of the dictionary up to HERE, which includes
+ * the user variables, the stacks of the main task and the native words.
+ * Taking and restoring one takes time proportional to the used size.
+ */
+
+struct snapshot {
+	uint32_t magic;
+	zf_addr here;
+	zf_addr dsp;
+	zf_addr rsp;
+	zf_addr natives;
+	zf_addr heads;          /* size of the split headers at the end */
+};
+
+static size_t snapshot_size(const struct snapshot *h)
+{
+	return sizeof(*h) + h->natives * sizeof(zf_native) +
+		(h->dsp + h->rsp) * sizeof(zf_cell) + h->here + h->heads;
+}
+
+
+/*
+ * Write a snapshot of an idle context to 'buf'. Returns the size of the
+ * snapshot, which is only written if it fits in 'len', or 0 if the context
+ * is in the middle of an evaluation.
+ */
+
+size_t zf_snapshot(zf_ctx *ctx, void *buf, size_t len)
+{
+	uint8_t *p = (uint8_t *)buf;
+	struct snapshot h;
+	size_t size;
+
+	if(ctx->ip != 0) {
+		return 0;
+	}
+
+	h.magic = ZF_SNAPSHOT_MAGIC;
+	h.here = HERE(ctx);
+	h.dsp = DSP(ctx);
+	h.rsp = RSP(ctx);
+	h.natives = NATIVE_COUNT(ctx);
+	h.heads = HEADS_SIZE(ctx);
+
+	size = snapshot_size(&h);
+
+	if(buf && len >= size) {
+		memcpy(p, &h, sizeof(h)); p += sizeof(h);
+#if ZF_ENABLE_NATIVES
+		memcpy(p, ctx->native, h.natives * sizeof(zf_native)); p += h.natives * sizeof(zf_native);
+#endif
+		memcpy(p, ctx->dstack, h.dsp * sizeof(zf_cell)); p += h.dsp * sizeof(zf_cell);
+		memcpy(p, ctx->rstack, h.rsp * sizeof(zf_cell)); p += h.rsp * sizeof(zf_cell);
+		memcpy(p, ctx->dict, h.here); p += h.here;
+		memcpy(p, ctx->dict + HP(ctx), h.heads);
+	}
+
+	return size;
+}
+
+
+/*
+ * Restore a context from a snapshot. The context does not need to be
+ * initialized; any evaluation in progress is dropped.
+ */
+
+zf_result zf_restore(zf_ctx *ctx, const void *buf, size_t len)
+{
+	const uint8_t *p = (const uint8_t *)buf;
+	const uint8_t *dict;
+	struct snapshot h;
+	zf_addr uv[ZF_USERVAR_COUNT], hp, latest;
+
+	if(len < sizeof(h)) {
+		return ZF_ABORT_INVALID_SIZE;
+	}
+
+	memcpy(&h, p, sizeof(h)); p += sizeof(h);
+
+	if(h.magic != ZF_SNAPSHOT_MAGIC || h.here + h.heads > ZF_DICT_SIZE ||
+	   h.here < ZF_USERVAR_COUNT * sizeof(zf_addr) ||
+	   h.natives > NATIVE_COUNT_MAX || len < snapshot_size(&h)) {
+		return ZF_ABORT_INVALID_SIZE;
+	}
+#if ZF_ENABLE_STACK_SPILL
+	if(h.dsp > ZF_DSTACK_MAX || h.rsp > ZF_RSTACK_MAX) {
+		return ZF_ABORT_INVALID_SIZE;
+	}
+#else
+	if(h.dsp > ZF_DSTACK_SIZE || h.rsp > ZF_RSTACK_SIZE) {
+		return ZF_ABORT_INVALID_SIZE;
+	}
+#endif
+
+	/* The user variables of the image have to agree with the header: the
+	 * dictionary and stack pointers, the headers fit where they start, and
+	 * the latest word is among them. Nothing is changed until the snapshot
+	 * is checked */
+
+	dict = p + h.natives * sizeof(zf_native) + (h.dsp + h.rsp) * sizeof(zf_cell);
+	memcpy(uv, dict, sizeof(uv));
+	hp = uv[ZF_USERVAR_HP];
+	latest = uv[ZF_USERVAR_LATEST];
+	if(uv[ZF_USERVAR_HERE] != h.here || uv[ZF_USERVAR_DSP] != h.dsp ||
+	   uv[ZF_USERVAR_RSP] != h.rsp) {
+		return ZF_ABORT_INVALID_SIZE;
+	}
+#if ZF_ENABLE_SPLIT_HEADERS
+	if(hp < h.here || hp > HEADS_TOP || h.heads != HEADS_TOP - hp ||
+	   (latest != 0 && (latest < hp || latest >= HEADS_TOP))) {
+		return ZF_ABORT_INVALID_SIZE;
+	}
+#else
+	if(h.heads != 0 || hp != 0 || latest >= h.here) {
+		return ZF_ABORT_INVALID_SIZE;
+	}
+#endif
+
+	reset(ctx);
+#if ZF_ENABLE_STACK_SPILL
+	if(!stack_reserve(ctx, h.dsp, h.rsp)) {
+		return ZF_ABORT_OUTSIDE_MEM;
+	}
+#endif
+#if ZF_ENABLE_NATIVES
+	memcpy(ctx->native, p, h.natives * sizeof(zf_native)); p += h.natives * sizeof(zf_native);
+	ctx->native_count = h.natives;
+#endif
+	memcpy(ctx->dstack, p, h.dsp * sizeof(zf_cell)); p += h.dsp * sizeof(zf_cell);
+	memcpy(ctx->rstack, p, h.rsp * sizeof(zf_cell)); p += h.rsp * sizeof(zf_cell);
+	memcpy(ctx->dict, p, h.here); p += h.here;
+	memcpy(ctx->dict + hp, p, h.heads);
+
+	return ZF_OK;
+}
+
+
+/*
+ * Copy everything but the dictionary from 'src' to 'dst'
+ */
+
+static zf_result clone_state(zf_ctx *dst, zf_ctx *src)
+{
+	if(src->ip != 0) {
+		return ZF_ABORT_INTERNAL_ERROR;
+	}
+
+	reset(dst);
+#if ZF_ENABLE_STACK_SPILL
+	if(!stack_reserve(dst, DSP(src), RSP(src))) {
+		return ZF_ABORT_INTERNAL_ERROR;
+	}
+#endif
+#if ZF_ENABLE_NATIVES
+	memcpy(dst->native, src->native, src->native_count * sizeof(zf_native));
+	dst->native_count = src->native_count;
+#endif
+	memcpy(dst->dstack, src->dstack, DSP(src) * sizeof(zf_cell));
+	memcpy(dst->rstack, src->rstack, RSP(src) * sizeof(zf_cell));
+
+	return ZF_OK;
+}
+
+
+/*
+ * Make 'dst' a copy of the idle context 'src', without the intermediate
+ * snapshot. Returns ZF_ABORT_INTERNAL_ERROR if 'src' is evaluating.
+ */
+
+zf_result zf_clone(zf_ctx *dst, zf_ctx *src)
+{
+	zf_result rv = clone_state(dst, src);
+
+	if(rv == ZF_OK) {
+		memcpy(dst->dict, src->dict, HERE(src));
+		memcpy(dst->dict + HP(src), src->dict + HP(src), HEADS_SIZE(src));
+	}
+
+	return rv;
+}
+
+
+#if ZF_ENABLE_EXTERNAL_DICT
+
+/*
+ * Like zf_clone(), but 'dict' already holds the dictionary of 'src', for
+ * example as a copy-on-write mapping of the same memory. Only the state
+ * outside the dictionary is copied.
+ */
+
+zf_result zf_clone_mapped(zf_ctx *dst, zf_ctx *src, uint8_t *dict)
+{
+	dst->dict = dict;
+	return clone_state(dst, src);
+}
+
+#endif
+
+zf_result zf_uservar_set(zf_ctx *ctx, zf_uservar_id uv, zf_cell v)
+{
+	zf_result result = ZF_ABORT_INVALID_USERVAR;
+
+	if (uv < ZF_USERVAR_COUNT) {
+		ctx->uservar[uv] = v;
+		result = ZF_OK;
+	}
+
+	return result;
+}
+
+zf_result zf_uservar_get(zf_ctx *ctx, zf_uservar_id uv, zf_cell *v)
+{
+	zf_result result = ZF_ABORT_INVALID_USERVAR;
+
+	if (uv < ZF_USERVAR_COUNT) {
+		if (v != NULL) {
+			*v = ctx->uservar[uv];
+		}
+		result = ZF_OK;
+	}
+
+	return result;
+}
+
+
+/*
+ * Find word by name, returning its execution token
+ */
+
+int zf_find(zf_ctx *ctx, const char *name, zf_addr *xt)
+{
+	zf_addr w;
+	return find_word(ctx, name, &w, xt);
+}
+
+
+#if ZF_ENABLE_NATIVES
+
+/*
+ * Bind a host function to a word with its own opcode, so calling it costs no
+ * more than a primitive. When the dictionary already has a native word with
+ * this name, eg. after loading a saved dictionary, the function is bound to
+ * its opcode. Returns the opcode, or -1 if the table is full.
+ */
+
+int zf_register_native(zf_ctx *ctx, const char *name, zf_native_fn fn, int din, int dout)
+{
+	zf_addr w, xt, op = PRIM_COUNT + ctx->native_count;
+	zf_cell d;
+	int found = 0;
+
+	if(find_word(ctx, name, &w, &xt)) {
+		dict_get_cell(ctx, w, &d);
+		if((int)d & ZF_FLAG_PRIM) {
+			dict_get_cell(ctx, xt, &d);
+			if(d >= PRIM_COUNT && d < PRIM_COUNT + ZF_NATIVE_COUNT) {
+				op = d;
+				found = 1;
+			}
+		}
+	}
+
+	/* The opcodes can not be used before the dictionary extends past
+	 * them, or they could be the address of a word */
+
+	if(op >= PRIM_COUNT + ZF_NATIVE_COUNT || HERE(ctx) < PRIM_COUNT + ZF_NATIVE_COUNT) {
+		return -1;
+	}
+
+	if(!found) {
+		create(ctx, name, ZF_FLAG_PRIM);
+		dict_add_op(ctx, op);
+		dict_add_op(ctx, PRIM_EXIT);
+		ctx->native_count ++;
+	} else if(op >= PRIM_COUNT + ctx->native_count) {
+		ctx->native_count = op - PRIM_COUNT + 1;
+	}
+
+	ctx->native[op - PRIM_COUNT].fn = fn;
+	ctx->native[op - PRIM_COUNT].din = din;
+	ctx->native[op - PRIM_COUNT].dout = dout;
+	return op;
+}
+
+#endif
+
+
+/*
+ * Number of primitives, and their names as found in the dictionary
+ */
+
+unsigned int zf_prim_count(void)
+{
+	return PRIM_COUNT;
+}
+
+const char *zf_prim_name(unsigned int prim)
+{
+	const char *p = prim_names;
+
+	if(prim >= PRIM_COUNT) {
+		return NULL;
+	}
+	while(prim--) {
+		p += strlen(p) + 1;
+	}
+	return *p == '_' ? p + 1 : p;
+}
+
+
+#if ZF_ENABLE_PRIM_STATS
+
+/*
+ * Count the primitives run by the inner interpreter into 'stats', or stop
+ * counting with NULL. 'stats' holds zf_prim_count() counts per primitive,
+ * followed by zf_prim_count() squared counts of pairs, indexed by the
+ * previous primitive times zf_prim_count() plus the next one. The host owns
+ * the memory and clears it.
+ */
+
+void zf_prim_stats(zf_ctx *ctx, uint64_t *stats)
+{
+	ctx->prim_stats = stats;
+	ctx->prim_last = PRIM_COUNT;
+}
+
+#endif
+
+
+#if ZF_ENABLE_ANALYZE
+
+/*
+ * Stack effects of all primitives: the number of cells popped from and
+ * pushed to the data stack, followed by the same for the return stack. Make
+ * sure this table always matches the zf_prim enum. Primitives with an effect
+ * depending on their arguments or on control flow are handled in analyze()
+ */
+
+#define E(din, dout, rin, rout) { din, dout, rin, rout }
+
+static const struct {
+	uint8_t din, dout, rin, rout;
+} prim_effects[] = {
+	E(0,0,0,0), E(0,1,0,0), E(1,1,0,0), E(0,0,0,0), E(0,0,0,0), E(2,1,0,0),
+	E(2,1,0,0), E(2,1,0,0), E(2,1,0,0), E(2,1,0,0), E(1,0,0,0), E(1,2,0,0),
+	E(1,1,0,0), E(0,0,0,0), E(2,1,0,0), E(3,0,0,0), E(2,2,0,0), E(3,3,0,0),
+	E(0,0,0,0), E(1,0,0,0), E(0,1,0,0), E(0,0,0,0), E(1,0,0,1), E(0,1,1,0),
+	E(2,1,0,0), E(1,0,0,0), E(1,1,0,0), E(2,0,0,0), E(0,1,0,0), E(0,2,0,0),
+	E(2,1,0,0), E(2,1,0,0), E(2,1,0,0), E(2,1,0,0), E(2,1,0,0), E(2,1,0,0),
+	E(1,0,0,0), E(0,0,0,0), E(0,0,0,0), E(1,1,0,0), E(1,1,0,0), E(1,0,0,0),
+	E(1,2,0,0), E(2,0,0,3), E(0,0,0,0), E(1,0,0,0), E(0,1,0,0), E(0,1,0,0),
+	E(0,0,3,0), E(0,0,3,0), E(0,0,0,1), E(0,0,0,0), E(0,1,0,0), E(1,0,0,0),
+#if ZF_ENABLE_EXT_PRIMS
+	E(2,3,0,0), E(2,1,0,0), E(2,3,0,0), E(2,4,0,0), E(2,0,0,0), E(2,1,0,0),
+	E(2,1,0,0), E(2,1,0,0), E(2,1,0,0), E(1,1,0,0), E(1,1,0,0), E(1,1,0,0),
+	E(1,1,0,0), E(1,1,0,0), E(2,1,0,0), E(2,1,0,0), E(2,0,0,0),
+#endif
+#if ZF_ENABLE_LOCALS
+	E(0,0,0,0), E(0,0,0,0),
+#endif
+#if ZF_ENABLE_CATCH
+	E(1,1,0,0), E(1,0,0,0),
+#endif
+#if ZF_ENABLE_TASKS
+	E(1,0,0,0), E(0,0,0,0),
+#endif
+};
+
+#define ANALYZE_PATHS 16  /* Max number of branch targets in one word */
+#define ANALYZE_DEPTH 16  /* Max nesting depth of called words */
+
+struct analyze_path {
+	zf_addr ip;
+	int d, r;
+	int f;          /* return stack depth before the frame of locals, or -1 */
+};
+
+
+/*
+ * Read cell from the code being analyzed; unlike dict_get_cell() this does
+ * not abort on bad addresses, since the analyzer can be called from outside
+ * zf_eval()
+ */
+
+static int analyze_get(zf_ctx *ctx, zf_addr *ip, zf_cell *v)
+{
+	if(*ip >= HERE(ctx) || *ip >= ZF_DICT_SIZE - sizeof(zf_cell) - 1) {
+		return 0;
+	}
+	*ip += dict_get_cell(ctx, *ip, v);
+	return 1;
+}
+
+
+/*
+ * Walk the code of the given word along all branches, tracking the stack
+ * depths relative to the entry of the word. Called words are analyzed
+ * recursively, 'callers' holds the words currently being analyzed to detect
+ * recursion.
+ */
+
+static zf_effect_status analyze(zf_ctx *ctx, zf_addr xt, zf_effect *effect, zf_addr *callers, int level)
+{
+	struct analyze_path todo[ANALYZE_PATHS], seen[ANALYZE_PATHS], p;
+	int ntodo = 0, nseen = 0, i;
+	int dmin = 0, dmax = 0, rmax = 0, dend = 0, ended = 0;
+
+	callers[level] = xt;
+	todo[0].ip = xt;
+	todo[0].d = todo[0].r = 0;
+	todo[0].f = -1;
+	ntodo = 1;
+
+	while(ntodo > 0) {
+
+		int target = 1, done = 0;
+		zf_cell lit = -1;
+		p = todo[--ntodo];
+
+		while(!done) {
+			zf_cell d;
+			zf_addr code, dest = 0;
+			int din, dout, rin, rout;
+
+			/* Paths joining at a branch target must agree on the
+			 * stack depths; past that point the code is known */
+
+			if(target) {
+				for(i=0; i<nseen && seen[i].ip != p.ip; i++);
+				if(i < nseen) {
+					if(seen[i].d != p.d || seen[i].r != p.r) {
+						return ZF_EFFECT_UNBALANCED;
+					}
+					break;
+				}
+				if(nseen == ANALYZE_PATHS) return ZF_EFFECT_DYNAMIC;
+				seen[nseen++] = p;
+				target = 0;
+			}
+
+			if(!analyze_get(ctx, &p.ip, &d)) return ZF_EFFECT_INVALID;
+			code = d;
+
+			if(code >= PRIM_COUNT + NATIVE_COUNT(ctx)) {
+
+				/* Call to another word, apply its effect */
+
+				zf_effect e;
+				zf_effect_status status;
+
+				for(i=0; i<=level; i++) {
+					if(callers[i] == code) return ZF_EFFECT_DYNAMIC;
+				}
+				if(level+1 == ANALYZE_DEPTH) return ZF_EFFECT_DYNAMIC;
+				status = analyze(ctx, code, &e, callers, level+1);
+				if(status != ZF_EFFECT_OK) return status;
+
+				if(p.d - e.din + e.dmax > dmax) dmax = p.d - e.din + e.dmax;
+				if(p.r + 1 + e.rmax > rmax) rmax = p.r + 1 + e.rmax;
+				din = e.din; dout = e.dout;
+				rin = rout = 0;
+
+#if ZF_ENABLE_NATIVES
+			} else if(code >= PRIM_COUNT) {
+
+				din = ctx->native[code - PRIM_COUNT].din;
+				dout = ctx->native[code - PRIM_COUNT].dout;
+				rin = rout = 0;
+#endif
+
+			} else {
+
+				din = prim_effects[code].din;
+				dout = prim_effects[code].dout;
+				rin = prim_effects[code].rin;
+				rout = prim_effects[code].rout;
+
+				switch(code) {
+
+					case PRIM_EXIT:
+						/* A non-empty return stack means the word
+						 * jumps to a computed address, as 'exe' does */
+						if(p.r != 0) return ZF_EFFECT_DYNAMIC;
+						if(ended && p.d != dend) return ZF_EFFECT_UNBALANCED;
+						dend = p.d;
+						ended = done = 1;
+						break;
+
+					case PRIM_LIT:
+						if(!analyze_get(ctx, &p.ip, &lit)) return ZF_EFFECT_INVALID;
+						break;
+
+					case PRIM_TICK:
+						if(!analyze_get(ctx, &p.ip, &d)) return ZF_EFFECT_INVALID;
+						break;
+
+					case PRIM_LITS:
+						if(!analyze_get(ctx, &p.ip, &d)) return ZF_EFFECT_INVALID;
+						p.ip += d;
+						break;
+
+					case PRIM_JMP:
+					case PRIM_JMP0:
+					case PRIM_DO:
+					case PRIM_LOOP:
+					case PRIM_PLOOP:
+						if(!analyze_get(ctx, &p.ip, &d)) return ZF_EFFECT_INVALID;
+						dest = d;
+						break;
+
+					case PRIM_FRAME:
+						/* The frame holds the saved frame pointer
+						 * and the locals */
+						if(!analyze_get(ctx, &p.ip, &d)) return ZF_EFFECT_INVALID;
+						rout = (int)d + 1;
+						if(!analyze_get(ctx, &p.ip, &d)) return ZF_EFFECT_INVALID;
+						din = d;
+						p.f = p.r;
+						break;
+
+					case PRIM_UNFRAME:
+						if(p.f < 0) return ZF_EFFECT_DYNAMIC;
+						rin = p.r - p.f;
+						p.f = -1;
+						break;
+
+					case PRIM_LOCAL_GET:
+					case PRIM_LOCAL_SET:
+						if(!analyze_get(ctx, &p.ip, &d)) return ZF_EFFECT_INVALID;
+						break;
+
+					case PRIM_I:
+					case PRIM_J:
+						/* The loop must be in the own part of the
+						 * return stack */
+						if(p.r < (code == PRIM_I ? 3 : 6)) return ZF_EFFECT_DYNAMIC;
+						break;
+
+					case PRIM_LEAVE:
+						/* Continues at the end of the loop, which
+						 * is a path of the loop start */
+						done = 1;
+						break;
+
+					case PRIM_PICK:
+						/* 'n pick' needs n+1 cells below n */
+						if(lit < 0) return ZF_EFFECT_DYNAMIC;
+						din = dout = (int)lit + 2;
+						break;
+
+					case PRIM_PICKR:
+						/* Only the own part of the return stack is known */
+						if(lit < 0 || (int)lit >= p.r) return ZF_EFFECT_DYNAMIC;
+						break;
+
+#if ZF_ENABLE_CATCH
+					case PRIM_CATCH:
+						/* Runs a word only known at run time */
+						return ZF_EFFECT_DYNAMIC;
+#endif
+
+					case PRIM_SYS:
+						if(lit < 0 || !zf_host_sys_effect(ctx, (zf_syscall_id)lit, &din, &dout)) {
+							return ZF_EFFECT_DYNAMIC;
+						}
+						din ++;
+						break;
+				}
+			}
+
+			p.d -= din;
+			if(p.d < dmin) dmin = p.d;
+			p.d += dout;
+			if(p.d > dmax) dmax = p.d;
+			p.r -= rin;
+			if(p.r < 0) return ZF_EFFECT_DYNAMIC;
+			p.r += rout;
+			if(p.r > rmax) rmax = p.r;
+
+			/* Arguments for pick, pickr and sys are only known when
+			 * they come straight from a literal */
+
+			if(code != PRIM_LIT) lit = -1;
+
+			if(code == PRIM_JMP0) {
+				if(ntodo == ANALYZE_PATHS) return ZF_EFFECT_DYNAMIC;
+				todo[ntodo] = p;
+				todo[ntodo++].ip = dest;
+			}
+
+			if(code == PRIM_JMP) {
+				p.ip = dest;
+				target = 1;
+			}
+
+			/* Loops continue after their end with the loop parameters
+			 * dropped, or jump back to the start of the body */
+
+			if(code == PRIM_DO || code == PRIM_LOOP || code == PRIM_PLOOP) {
+				if(ntodo == ANALYZE_PATHS) return ZF_EFFECT_DYNAMIC;
+				todo[ntodo] = p;
+				todo[ntodo].ip = dest;
+				if(code == PRIM_DO) {
+					todo[ntodo].r -= 3;
+				} else {
+					p.r -= 3;
+				}
+				ntodo++;
+			}
+		}
+	}
+
+	effect->din = -dmin;
+	effect->dout = dend - dmin;
+	effect->dmax = dmax - dmin;
+	effect->rmax = rmax;
+	return ZF_EFFECT_OK;
+}
+
+
+/*
+ * Infer the stack effect of the word with the given execution token, and
+ * the peak stack use when running it.
+ */
+
+zf_effect_status zf_analyze(zf_ctx *ctx, zf_addr xt, zf_effect *effect)
+{
+	zf_addr callers[ANALYZE_DEPTH];
+	return analyze(ctx, xt, effect, callers, 0);
+}
+
+#endif
+
+
+#if ZF_ENABLE_IMAGE_TOOLS
+
+/*
+ * Dictionary rewriting, for inline headers only. The words form a list
+ * through their links, from LATEST down to the first primitive; a word spans
+ * the dictionary from its header up to the header of the next word, or to
+ * HERE.
+ *
+ * The code of a word is decoded up to the first exit beyond all jump
+ * targets and return addresses pushed with 'lit >r' (see 'exe'). What
+ * follows that exit, like the value of a 'var', is data and is not decoded.
+ */
+
+#define REF_ADDR 0      /* call, jump target, ticked word or return address */
+#define REF_LIT  1      /* literal, possibly an address */
+
+typedef void (*ref_fn)(zf_ctx *ctx, zf_addr cell, zf_cell v, int kind, void *arg);
+
+static zf_addr word_end(zf_ctx *ctx, zf_addr w)
+{
+	zf_addr v, link, end = HERE(ctx);
+
+	for(v=LATEST(ctx); v && v != w; v=link) {
+		header(ctx, v, NULL, &link, NULL);
+		end = v;
+	}
+
+	return end;
+}
+
+
+/*
+ * Find the word spanning address 'a', returns 0 if there is none
+ */
+
+static zf_addr word_at(zf_ctx *ctx, zf_addr a)
+{
+	zf_addr v, link;
+
+	if(a >= HERE(ctx)) {
+		return 0;
+	}
+
+	for(v=LATEST(ctx); v && v > a; v=link) {
+		header(ctx, v, NULL, &link, NULL);
+	}
+
+	return v;
+}
+
+
+/*
+ * Call fn() for each cell in the code of word 'w' which may hold an
+ * address. Returns the end of the code, or 0 if it runs past the word.
+ */
+
+static zf_addr walk_code(zf_ctx *ctx, zf_addr w, ref_fn fn, void *arg)
+{
+	zf_addr end = word_end(ctx, w), ip, last, cell, op;
+	zf_cell d, v;
+	int flags;
+
+	ip = last = header(ctx, w, &flags, NULL, NULL);
+
+	if(flags & ZF_FLAG_PRIM) {
+		return ip;
+	}
+
+	while(ip < end) {
+		cell = ip;
+		ip += dict_get_cell(ctx, ip, &d);
+		op = d;
+
+		if(op >= PRIM_COUNT + NATIVE_COUNT(ctx)) {
+			if(fn) fn(ctx, cell, d, REF_ADDR, arg);
+			continue;
+		}
+
+		switch(op) {
+
+			case PRIM_EXIT:
+				if(last < ip) return ip;
+				break;
+
+			case PRIM_LIT:
+				cell = ip;
+				ip += dict_get_cell(ctx, ip, &v);
+				dict_get_cell(ctx, ip, &d);
+				if(d == PRIM_PUSHR && v > cell && v < end) {
+					if(v > last) last = v;
+					if(fn) fn(ctx, cell, v, REF_ADDR, arg);
+				} else {
+					if(fn) fn(ctx, cell, v, REF_LIT, arg);
+				}
+				break;
+
+			case PRIM_JMP:
+			case PRIM_JMP0:
+			case PRIM_DO:
+			case PRIM_LOOP:
+			case PRIM_PLOOP:
+			case PRIM_TICK:
+				cell = ip;
+				ip += dict_get_cell(ctx, ip, &v);
+				if(op != PRIM_TICK && v > last && v < end) last = v;
+				if(fn) fn(ctx, cell, v, REF_ADDR, arg);
+				break;
+
+			case PRIM_LITS:
+				ip += dict_get_cell(ctx, ip, &v);
+				ip += v;
+				break;
+
+			case PRIM_FRAME:
+				ip += dict_get_cell(ctx, ip, &v);
+				ip += dict_get_cell(ctx, ip, &v);
+				break;
+
+			case PRIM_LOCAL_GET:
+			case PRIM_LOCAL_SET:
+				ip += dict_get_cell(ctx, ip, &v);
+				break;
+
+			default:
+				break;
+		}
+	}
+
+	/* Without an exit, like a definition that was aborted, the code must
+	 * end with the word */
+
+	return ip == end ? ip : 0;
+}
+
+
+/*
+ * Write a cell with the given encoded size, which must be able to hold it
+ */
+
+static void put_cell_sized(zf_ctx *ctx, zf_addr addr, zf_cell v, zf_addr size)
+{
+	unsigned int vi = v;
+	uint8_t t[2];
+
+	if(size == 1) {
+		t[0] = vi;
+		dict_put_bytes(ctx, addr, t, 1);
+	} else if(size == 2) {
+		t[0] = (vi >> 8) | 0x80;
+		t[1] = vi;
+		dict_put_bytes(ctx, addr, t, 2);
+	} else {
+		dict_put_cell_typed(ctx, addr, v, ZF_MEM_SIZE_VAR_MAX);
+	}
+}
+
+
+static void set_link(zf_ctx *ctx, zf_addr w, zf_addr link)
+{
+	zf_cell d;
+	zf_addr p = w + dict_get_cell(ctx, w, &d);
+	put_cell_sized(ctx, p, link, dict_get_cell(ctx, p, &d));
+}
+
+
+/*
+ * Bitmaps over the dictionary addresses: the headers of the live words and
+ * of those keeping their name, the execution tokens of all words, and the
+ * bytes that are removed. The runs of
+ * removed bytes are listed by their end, with the count of bytes removed up
+ * to there, for relocating addresses.
+ */
+
+#define MAP_SIZE (ZF_DICT_SIZE / 8 + 1)
+#define RUN_MAX  (ZF_DICT_SIZE / 2 + 1)
+#define BIT(m, a)     ((m)[(a) / 8] & (1 << ((a) % 8)))
+#define SET_BIT(m, a) ((m)[(a) / 8] |= 1 << ((a) % 8))
+
+struct compact {
+	uint8_t live[MAP_SIZE];
+	uint8_t named[MAP_SIZE];
+	uint8_t xt[MAP_SIZE];
+	uint8_t dead[MAP_SIZE];
+	zf_addr run_end[RUN_MAX];
+	zf_addr run_removed[RUN_MAX];
+	zf_addr runs;
+	zf_addr word, end;      /* word being relocated */
+	int changed;
+};
+
+
+/*
+ * Remove a range of bytes. Code must stay above the opcodes of the
+ * primitives and native words, so nothing below them is removed
+ */
+
+static void set_dead(struct compact *c, zf_addr from, zf_addr to)
+{
+	if(from < PRIM_COUNT + NATIVE_COUNT_MAX) {
+		from = PRIM_COUNT + NATIVE_COUNT_MAX;
+	}
+	for(; from<to; from++) {
+		SET_BIT(c->dead, from);
+	}
+}
+
+
+static int is_addr(zf_ctx *ctx, zf_cell v)
+{
+	return v >= 0 && v == (zf_addr)v && (zf_addr)v < HERE(ctx);
+}
+
+
+/*
+ * Mark the word spanning a referenced address as live. A literal only
+ * counts when it holds an execution token, which relocate_ref() rewrites;
+ * other literals are numbers.
+ */
+
+static void mark_ref(zf_ctx *ctx, zf_addr cell, zf_cell v, int kind, void *arg)
+{
+	struct compact *c = (struct compact *)arg;
+	zf_addr w;
+
+	if(is_addr(ctx, v) && (kind != REF_LIT || BIT(c->xt, (zf_addr)v)) &&
+	   (w = word_at(ctx, v)) != 0 && !BIT(c->live, w)) {
+		SET_BIT(c->live, w);
+		c->changed = 1;
+	}
+}
+
+
+/*
+ * List the runs of removed bytes below 'end'
+ */
+
+static void find_runs(struct compact *c, zf_addr end)
+{
+	zf_addr a, removed = 0;
+
+	c->runs = 0;
+	for(a=0; a<end; a++) {
+		if(BIT(c->dead, a)) {
+			removed ++;
+			if(a + 1 == end || !BIT(c->dead, a + 1)) {
+				c->run_end[c->runs] = a + 1;
+				c->run_removed[c->runs] = removed;
+				c->runs ++;
+			}
+		}
+	}
+}
+
+
+/*
+ * New address of 'a' after the bytes below it are removed: subtract the
+ * bytes removed up to the last run ending at or below it
+ */
+
+static zf_addr relocate(struct compact *c, zf_addr a)
+{
+	zf_addr lo = 0, hi = c->runs, mid;
+
+	while(lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if(c->run_end[mid] <= a) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return lo ? a - c->run_removed[lo - 1] : a;
+}
+
+
+/*
+ * Relocate an address in the code of the word being relocated. A literal
+ * is a number unless it is the execution token of a word, as compiled by
+ * "[ ' name ] literal", or points into that same word, like the address of
+ * the data of a 'var'
+ */
+
+static void relocate_ref(zf_ctx *ctx, zf_addr cell, zf_cell v, int kind, void *arg)
+{
+	struct compact *c = (struct compact *)arg;
+	zf_addr a = v, n;
+	zf_cell d;
+
+	if(!is_addr(ctx, v) || BIT(c->dead, a) ||
+	   (kind == REF_LIT && !BIT(c->xt, a) && (a < c->word || a >= c->end))) {
+		return;
+	}
+
+	n = relocate(c, a);
+	if(n != a) {
+		put_cell_sized(ctx, cell, n, dict_get_cell(ctx, cell, &d));
+	}
+}
+
+
+/*
+ * Remove the words that are not live and move the remaining words down,
+ * given the live roots. Addresses of calls, jumps, ticked words, return
+ * addresses, literals holding an execution token and literals pointing
+ * into their own word are relocated, as are the links in the headers.
+ * Other literals are left alone, even when they happen to equal another
+ * address in the dictionary.
+ * Relocated cells keep their encoded size, so no code changes length.
+ * Addresses stored in data, like the value of a variable, are not
+ * relocated. With 'strip', only the roots keep their header.
+ */
+
+static zf_result rewrite(zf_ctx *ctx, struct compact *c, int strip)
+{
+	zf_addr w, link, end, code, prev, latest, n, removed;
+
+	if(strip) {
+		memcpy(c->named, c->live, sizeof(c->named));
+	}
+
+	for(w=LATEST(ctx); w; w=link) {
+		SET_BIT(c->xt, header(ctx, w, NULL, &link, NULL));
+	}
+
+	/* Add everything referenced by live words, checking that all of
+	 * their code decodes */
+
+	do {
+		c->changed = 0;
+		for(w=LATEST(ctx); w; w=link) {
+			header(ctx, w, NULL, &link, NULL);
+			if(BIT(c->live, w) && walk_code(ctx, w, mark_ref, c) == 0) {
+				return ZF_ABORT_OUTSIDE_MEM;
+			}
+		}
+	} while(c->changed);
+
+	if(!strip) {
+		memcpy(c->named, c->live, sizeof(c->named));
+	}
+
+	/* Everything of a dead word goes, and the header of a live word that
+	 * is not named */
+
+	end = HERE(ctx);
+	for(w=LATEST(ctx); w; w=link) {
+		code = header(ctx, w, NULL, &link, NULL);
+		if(BIT(c->live, w)) {
+			if(!BIT(c->named, w)) {
+				set_dead(c, w, code);
+			}
+		} else {
+			set_dead(c, w, end);
+		}
+		end = w;
+	}
+
+	find_runs(c, HERE(ctx));
+
+	/* Relocate the code of the live words in place, then the links of the
+	 * named words. The link of a word is set when the next named word
+	 * down is known */
+
+	end = HERE(ctx);
+	for(w=LATEST(ctx); w; w=link) {
+		header(ctx, w, NULL, &link, NULL);
+		if(BIT(c->live, w)) {
+			c->word = w;
+			c->end = end;
+			walk_code(ctx, w, relocate_ref, c);
+		}
+		end = w;
+	}
+
+	prev = latest = 0;
+	for(w=LATEST(ctx); w; w=link) {
+		header(ctx, w, NULL, &link, NULL);
+		if(BIT(c->named, w)) {
+			if(prev) set_link(ctx, prev, relocate(c, w));
+			if(!latest) latest = w;
+			prev = w;
+		}
+	}
+	if(prev) set_link(ctx, prev, 0);
+
+	/* Move everything that stays down, lowest first */
+
+	end = HERE(ctx);
+	removed = 0;
+	for(n=0; n<end; n++) {
+		if(BIT(c->dead, n)) {
+			removed ++;
+		} else if(removed) {
+			ctx->dict[n - removed] = ctx->dict[n];
+		}
+	}
+
+	LATEST(ctx) = relocate(c, latest);
+	HERE(ctx) = end - removed;
+
+	return ZF_OK;
+}
+
+
+/*
+ * Remove the words that are shadowed by a newer word with the same name and
+ * not referenced by any other live word.
+ */
+
+zf_result zf_compact(zf_ctx *ctx)
+{
+	struct compact c;
+	zf_addr w, v, link, name, n;
+	int len;
+	zf_result r;
+
+	if(ctx->ip != 0 || COMPILING(ctx) || HP(ctx) != 0) {
+		return ZF_ABORT_INTERNAL_ERROR;
+	}
+
+	r = (zf_result)setjmp(ctx->jmpbuf);
+	if(r != ZF_OK) {
+		return r;
+	}
+
+	memset(&c, 0, sizeof(c));
+
+	/* Words that are found by their name are the roots */
+
+	for(w=LATEST(ctx); w; w=link) {
+		header(ctx, w, &len, &link, &name);
+		len = ZF_FLAG_LEN(len);
+		dict_get_bytes(ctx, name, ctx->name_buf, len);
+		ctx->name_buf[len] = '\0';
+		if(find_word(ctx, ctx->name_buf, &v, &n) && v == w) {
+			SET_BIT(c.live, w);
+		}
+	}
+
+	return rewrite(ctx, &c, 0);
+}
+
+
+/*
+ * Reduce the dictionary to the given root words and everything they use.
+ * Only the roots can be found by name afterwards, the other words lose
+ * their header.
+ */
+
+zf_result zf_shake(zf_ctx *ctx, const char **roots, int count)
+{
+	struct compact c;
+	zf_addr w, xt;
+	zf_result r;
+	int i;
+
+	if(ctx->ip != 0 || COMPILING(ctx) || HP(ctx) != 0) {
+		return ZF_ABORT_INTERNAL_ERROR;
+	}
+
+	r = (zf_result)setjmp(ctx->jmpbuf);
+	if(r != ZF_OK) {
+		return r;
+	}
+
+	memset(&c, 0, sizeof(c));
+
+	for(i=0; i<count; i++) {
+		if(!find_word(ctx, roots[i], &w, &xt)) {
+			return ZF_ABORT_NOT_A_WORD;
+		}
+		SET_BIT(c.live, w);
+	}
+
+	return rewrite(ctx, &c, 1);
+}
+
+#endif
+
 /*
  * End
  */
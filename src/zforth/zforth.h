@@ -28,13 +28,17 @@ typedef enum {
 	ZF_ABORT_INVALID_SIZE,
 	ZF_ABORT_DIVISION_BY_ZERO,
 	ZF_ABORT_INVALID_USERVAR,
-	ZF_ABORT_EXTERNAL
+	ZF_ABORT_EXTERNAL,
+	ZF_ABORT_NO_FREE_TASK,
+	ZF_ABORT_THROW,         /* 'throw' without a 'catch' */
+	ZF_YIELD                /* Not an abort: instruction budget spent */
 } zf_result;
 
 typedef enum {
 	ZF_INPUT_INTERPRET,
 	ZF_INPUT_PASS_CHAR,
-	ZF_INPUT_PASS_WORD
+	ZF_INPUT_PASS_WORD,
+	ZF_INPUT_PENDING        /* System call waits for the host, retry later */
 } zf_input_state;
 
 typedef enum {
@@ -52,24 +56,165 @@ typedef enum {
     ZF_USERVAR_POSTPONE,
     ZF_USERVAR_DSP,
     ZF_USERVAR_RSP,
+    ZF_USERVAR_BASE,
+    ZF_USERVAR_HP,
+    ZF_USERVAR_PROFILE,
 
     ZF_USERVAR_COUNT
 } zf_uservar_id;
 
+/* Result of static stack effect analysis, see zf_analyze() */
+
+typedef enum {
+	ZF_EFFECT_OK,
+	ZF_EFFECT_UNBALANCED,   /* branches join with different stack depths */
+	ZF_EFFECT_DYNAMIC,      /* depends on run time values, eg. exe or sys */
+	ZF_EFFECT_INVALID       /* code runs outside of the dictionary */
+} zf_effect_status;
+
+typedef struct {
+	int din;                /* data stack cells consumed */
+	int dout;               /* data stack cells produced */
+	int dmax;               /* peak data stack use, including the inputs */
+	int rmax;               /* peak return stack use, excluding the return address */
+} zf_effect;
+
+/* Binary trace events, see ZF_ENABLE_TRACE_EVENTS. The comments give the
+ * text trace each event stands for */
+
+#define ZF_TRACE_EVENTS 2
+
+typedef enum {
+	ZF_TRACE_EXEC,          /* instruction 'op' at 'addr', v is the top of stack */
+	ZF_TRACE_CALL,          /* call of word 'op' */
+	ZF_TRACE_PRIM,          /* primitive or native word 'op' */
+	ZF_TRACE_ENTER,         /* execution of word 'op' from the interpreter */
+	ZF_TRACE_PUSH,          /* v pushed to the data stack */
+	ZF_TRACE_POP,           /* v popped from the data stack */
+	ZF_TRACE_RPUSH,         /* v pushed to the return stack */
+	ZF_TRACE_RPOP,          /* v popped from the return stack */
+	ZF_TRACE_JUMP,          /* jump from 'addr' to 'op' */
+	ZF_TRACE_TICK,          /* ' of word 'op' */
+	ZF_TRACE_WRITE,         /* v written to 'addr' with memory size 'op' */
+	ZF_TRACE_ADD,           /* end of a cell added to the dictionary */
+	ZF_TRACE_OP,            /* opcode 'op' added to the dictionary */
+	ZF_TRACE_STR,           /* name added at 'addr' */
+	ZF_TRACE_CREATE,        /* word with the header at 'addr' created */
+	ZF_TRACE_END,           /* end of a header or a definition */
+	ZF_TRACE_SPILL,         /* stack spilled to a heap stack of v cells */
+	ZF_TRACE_TASK,          /* switch to task v */
+	ZF_TRACE_CATCH          /* catch ended with code v */
+} zf_trace_type;
+
+typedef struct {
+	zf_addr addr;
+	zf_addr op;
+	zf_cell v;
+	uint32_t time;          /* set by the host */
+	uint16_t rsp;           /* return stack depth */
+	uint16_t dsp;           /* data stack depth */
+	uint8_t type;           /* zf_trace_type */
+} zf_trace_event;
+
+
+/* Passed to zf_host_profile() instead of an instruction when the inner
+ * interpreter stops */
+
+#define ZF_PROFILE_STOP ((zf_addr)-1)
+
+
+/* Snapshots written by zf_snapshot() start with this */
+
+#define ZF_SNAPSHOT_MAGIC 0x7a66736e
+
+/* Without multitasking there is only the main task */
+
+#if !ZF_ENABLE_TASKS
+#undef ZF_TASK_COUNT
+#define ZF_TASK_COUNT 1
+#endif
 
 typedef struct {
-	/* Stacks and dictionary memory */
+	/* Stacks of the task, and the saved stack and instruction pointers
+	 * when the task is not running. A task with ip 0 is finished */
 	zf_cell rstack[ZF_RSTACK_SIZE];
 	zf_cell dstack[ZF_DSTACK_SIZE];
+	zf_addr ip;
+	zf_addr dsp;
+	zf_addr rsp;
+	zf_addr fp;
+#if ZF_ENABLE_CATCH
+	zf_addr handler;
+#endif
+#if ZF_ENABLE_STACK_SPILL
+	/* Heap stacks once a stack outgrew the one above, or NULL, and the
+	 * size in cells of the stacks in use */
+	zf_cell *rspill;
+	zf_cell *dspill;
+	zf_addr rsize;
+	zf_addr dsize;
+#endif
+} zf_task;
+
+
+/* Native words are host functions bound to a word with zf_register_native().
+ * They behave like zf_host_sys() without the syscall id */
+
+struct zf_ctx;
+
+typedef zf_input_state (*zf_native_fn)(struct zf_ctx *ctx, const char *last_word);
+
+typedef struct {
+	zf_native_fn fn;
+	int din;                /* data stack cells consumed, for zf_analyze() */
+	int dout;               /* data stack cells produced */
+} zf_native;
+
+
+typedef struct zf_ctx {
+	/* Tasks, task 0 is the main task running the interpreter */
+	zf_task task[ZF_TASK_COUNT];
+	unsigned int task_cur;
+
+	/* Stacks of the current task and dictionary memory. An external
+	 * dictionary of ZF_DICT_SIZE bytes is provided by the host, which sets
+	 * 'dict' before calling zf_init() or zf_restore() */
+	zf_cell *rstack;
+	zf_cell *dstack;
+#if ZF_ENABLE_EXTERNAL_DICT
+	uint8_t *dict;
+#else
 	uint8_t dict[ZF_DICT_SIZE];
+#endif
+
+#if ZF_ENABLE_NATIVES
+	/* Native words, dispatched by opcode */
+	zf_native native[ZF_NATIVE_COUNT];
+	unsigned int native_count;
+#endif
 
-	/* State and stack and interpreter pointers */
+	/* State and stack and interpreter pointers. The frame pointer is the
+	 * return stack index of the locals of the running word */
 	zf_input_state input_state;
 	zf_addr ip;
+	zf_addr fp;
+
+#if ZF_ENABLE_CATCH
+	/* Return stack index above the innermost 'catch' frame, or 0 */
+	zf_addr handler;
+#endif
 
 	/* setjmp env for handling aborts */
 	jmp_buf jmpbuf;
 
+	/* Remaining input and instruction budget of the current evaluation */
+	const char *src;
+	unsigned int slice;
+
+	/* Pictured number output, built downwards from hld_end */
+	zf_addr hld;
+	zf_addr hld_end;
+
 	/* Input buffer */
 	char read_buf[32];
 	size_t read_len;
@@ -77,6 +222,23 @@ typedef struct {
 	/* Name buffer */
 	char name_buf[32];
 
+#if ZF_ENABLE_LOCALS
+	/* Names of the locals of the word being compiled, \0 separated, and
+	 * the state of '{:' while it reads them */
+	char local_names[ZF_LOCAL_NAMES];
+	size_t local_len;
+	unsigned int local_count;
+	unsigned int local_init;
+	int local_mode;
+#endif
+
+#if ZF_ENABLE_PRIM_STATS
+	/* Counts of primitives and pairs of primitives, see zf_prim_stats(),
+	 * and the primitive which ran last */
+	uint64_t *prim_stats;
+	unsigned int prim_last;
+#endif
+
 	zf_addr *uservar;
 } zf_ctx;
 
@@ -89,9 +251,19 @@ typedef struct {
 /* ZForth API functions */
 
 void zf_init(zf_ctx *ctx, int trace);
+void zf_free(zf_ctx *ctx);
 void zf_bootstrap(zf_ctx *ctx);
 void *zf_dump(zf_ctx *ctx, size_t *len);
+size_t zf_snapshot(zf_ctx *ctx, void *buf, size_t len);
+zf_result zf_restore(zf_ctx *ctx, const void *buf, size_t len);
+zf_result zf_clone(zf_ctx *dst, zf_ctx *src);
+#if ZF_ENABLE_EXTERNAL_DICT
+zf_result zf_clone_mapped(zf_ctx *dst, zf_ctx *src, uint8_t *dict);
+#endif
 zf_result zf_eval(zf_ctx *ctx, const char *buf);
+zf_result zf_eval_slice(zf_ctx *ctx, const char *buf, unsigned int max);
+zf_result zf_run_slice(zf_ctx *ctx, unsigned int max);
+zf_result zf_call(zf_ctx *ctx, zf_addr xt);
 void zf_abort(zf_ctx *ctx, zf_result reason);
 
 void zf_push(zf_ctx *ctx, zf_cell v);
@@ -101,11 +273,33 @@ zf_cell zf_pick(zf_ctx *ctx, zf_addr n);
 zf_result zf_uservar_set(zf_ctx *ctx, zf_uservar_id uv, zf_cell v);
 zf_result zf_uservar_get(zf_ctx *ctx, zf_uservar_id uv, zf_cell *v);
 
+int zf_find(zf_ctx *ctx, const char *name, zf_addr *xt);
+const char *zf_op_name(zf_ctx *ctx, zf_addr addr, int opcode);
+#if ZF_ENABLE_NATIVES
+int zf_register_native(zf_ctx *ctx, const char *name, zf_native_fn fn, int din, int dout);
+#endif
+unsigned int zf_prim_count(void);
+const char *zf_prim_name(unsigned int prim);
+#if ZF_ENABLE_PRIM_STATS
+void zf_prim_stats(zf_ctx *ctx, uint64_t *stats);
+#endif
+#if ZF_ENABLE_ANALYZE
+zf_effect_status zf_analyze(zf_ctx *ctx, zf_addr xt, zf_effect *effect);
+#endif
+#if ZF_ENABLE_IMAGE_TOOLS
+zf_result zf_compact(zf_ctx *ctx);
+zf_result zf_shake(zf_ctx *ctx, const char **roots, int count);
+#endif
+
 /* Host provides these functions */
 
 zf_input_state zf_host_sys(zf_ctx *ctx, zf_syscall_id id, const char *last_word);
 void zf_host_trace(zf_ctx *ctx, const char *fmt, va_list va);
 zf_cell zf_host_parse_num(zf_ctx *ctx, const char *buf);
+int zf_host_sys_effect(zf_ctx *ctx, zf_syscall_id id, int *din, int *dout);
+void *zf_host_realloc(zf_ctx *ctx, void *ptr, size_t size);
+void zf_host_trace_event(zf_ctx *ctx, const zf_trace_event *ev);
+void zf_host_profile(zf_ctx *ctx, zf_addr op, zf_addr rsp, int call);
 
 #ifdef __cplusplus
 }